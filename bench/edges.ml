@@ -0,0 +1,61 @@
+(* Compares the edge engines of the rasterizer, on the example images and on
+   a generated drawing with many edges per shape. *)
+
+(* Star-shaped polygons with thousands of vertices each, and a grid of thin
+   strokes, which look like the shapes of maps or CAD drawings. *)
+let dense_svg () =
+  let b = Buffer.create (1 lsl 20) in
+  let st = Random.State.make [| 42 |] in
+  Buffer.add_string b
+    {|<svg xmlns="http://www.w3.org/2000/svg" width="800" height="600">|};
+  for _ = 1 to 30 do
+    let cx = 100. +. Random.State.float st 600. in
+    let cy = 100. +. Random.State.float st 400. in
+    let n = 3000 in
+    Buffer.add_string b {|<polygon points="|};
+    for i = 0 to n - 1 do
+      let a = 2. *. Float.pi *. float i /. float n in
+      let r = 20. +. Random.State.float st 180. in
+      Printf.bprintf b "%.2f,%.2f " (cx +. r *. cos a) (cy +. r *. sin a)
+    done;
+    Printf.bprintf b {|" fill="#%06x" fill-opacity="0.6" stroke="#000" stroke-width="0.5"/>|}
+      (Random.State.int st 0xffffff)
+  done;
+  Buffer.add_string b {|<path stroke="#335" stroke-width="0.7" d="|};
+  for i = 0 to 266 do
+    let x = 3 * i in
+    Printf.bprintf b "M%d 0 L%d 600 M0 %d L800 %d " x (x + 37) (x * 7 / 10) (x * 7 / 10 + 11)
+  done;
+  Buffer.add_string b {|"/></svg>|};
+  Buffer.contents b
+
+let time ~runs f =
+  f ();
+  let t0 = Sys.time () in
+  for _ = 1 to runs do f () done;
+  (Sys.time () -. t0) /. float runs
+
+let bench name img ~scale ~runs =
+  let w = int_of_float (Nanosvg.Image_data.width img *. scale) in
+  let h = int_of_float (Nanosvg.Image_data.height img *. scale) in
+  let dst = Bigarray.(Array1.create int8_unsigned c_layout (w * h * 4)) in
+  let run edge_engine =
+    let r = Nanosvg.Rasterizer.create ~edge_engine () in
+    time ~runs (fun () ->
+      Nanosvg.rasterize r img ~tx:0. ~ty:0. ~scale ~dst ~w ~h ())
+  in
+  let classic = run Nanosvg.Rasterizer.Edge_engine_classic in
+  let radix = run Nanosvg.Rasterizer.Edge_engine_radix in
+  Printf.printf "%-24s %5dx%-5d classic %8.2fms  radix %8.2fms  (x%.2f)\n%!"
+    name w h (classic *. 1000.) (radix *. 1000.) (classic /. radix)
+
+let () =
+  let runs = try int_of_string Sys.argv.(1) with _ -> 10 in
+  let dense = Nanosvg.parse (dense_svg ()) |> Option.get in
+  bench "dense" dense ~scale:1. ~runs;
+  bench "dense x2" dense ~scale:2. ~runs;
+  List.iter (fun file ->
+    match Nanosvg.parse_from_file file with
+    | Some img -> bench (Filename.basename file) img ~scale:2. ~runs
+    | None -> Printf.printf "%s: parse error\n" file
+  ) ["example/23.svg"; "example/drawing.svg"]
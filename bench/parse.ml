@@ -0,0 +1,52 @@
+(* Measures parsing time on generated documents with a growing number of
+   shapes and gradients. The time per shape should stay flat as the documents
+   grow. Loading the serialized images is given for comparison. *)
+
+let colors = [| "black"; "white"; "steelblue"; "tomato"; "yellowgreen"; "gray" |]
+
+(* [n] rectangles, and [n / 10] gradients half of which inherit their stops
+   from another gradient. Every other rectangle is painted with a gradient,
+   the others with a color keyword. *)
+let document n =
+  let b = Buffer.create (n * 128) in
+  let st = Random.State.make [| n |] in
+  let ngrads = max 2 (n / 10) in
+  Buffer.add_string b
+    {|<svg xmlns="http://www.w3.org/2000/svg" xmlns:xlink="http://www.w3.org/1999/xlink" width="1000" height="1000"><defs>|};
+  for i = 0 to ngrads - 1 do
+    if i mod 2 = 1 then
+      Printf.bprintf b {|<linearGradient id="grad%d" xlink:href="#grad%d" x2="0" y2="1"/>|} i (i - 1)
+    else
+      Printf.bprintf b
+        {|<linearGradient id="grad%d"><stop offset="0" stop-color="%s"/><stop offset="1" stop-color="#%06x"/></linearGradient>|}
+        i colors.(i mod Array.length colors) (Random.State.int st 0xffffff)
+  done;
+  Buffer.add_string b "</defs>";
+  for i = 0 to n - 1 do
+    let fill =
+      if i mod 2 = 0 then Printf.sprintf "url(#grad%d)" (Random.State.int st ngrads)
+      else colors.(Random.State.int st (Array.length colors)) in
+    Printf.bprintf b
+      {|<rect x="%.1f" y="%.1f" width="12" height="8" fill="%s" stroke="%s"/>|}
+      (Random.State.float st 990.) (Random.State.float st 990.) fill
+      colors.(i mod Array.length colors)
+  done;
+  Buffer.add_string b "</svg>";
+  Buffer.contents b
+
+let time ~runs f =
+  ignore (f ());
+  let t0 = Sys.time () in
+  for _ = 1 to runs do ignore (f ()) done;
+  (Sys.time () -. t0) /. float runs
+
+let () =
+  let runs = try int_of_string Sys.argv.(1) with _ -> 5 in
+  List.iter (fun n ->
+    let doc = document n in
+    let parse = time ~runs (fun () -> Nanosvg.parse doc) in
+    let data = Nanosvg.Image_data.to_bytes (Option.get (Nanosvg.parse doc)) in
+    let load = time ~runs (fun () -> Nanosvg.Image_data.of_bytes data) in
+    Printf.printf "%6d shapes %5d gradients  parse %8.2fms (%6.0fns/shape)  of_bytes %7.2fms\n%!"
+      n (max 2 (n / 10)) (parse *. 1000.) (parse *. 1e9 /. float n) (load *. 1000.)
+  ) [1_000; 4_000; 16_000; 64_000]
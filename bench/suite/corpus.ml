@@ -0,0 +1,118 @@
+(* Generated stress documents. Each one stresses a different part of the
+   parser or of the rasterizer; they are deterministic, so that results can be
+   compared across runs. *)
+
+let header b ~w ~h =
+  Printf.bprintf b
+    {|<svg xmlns="http://www.w3.org/2000/svg" xmlns:xlink="http://www.w3.org/1999/xlink" width="%d" height="%d">|}
+    w h
+
+let color st = Random.State.int st 0xffffff
+
+(* Many small filled shapes *)
+let many_shapes () =
+  let b = Buffer.create (1 lsl 20) in
+  let st = Random.State.make [| 1 |] in
+  header b ~w:1000 ~h:1000;
+  for i = 0 to 19_999 do
+    let x = Random.State.float st 990. and y = Random.State.float st 990. in
+    if i mod 2 = 0 then
+      Printf.bprintf b {|<rect x="%.1f" y="%.1f" width="8" height="6" fill="#%06x"/>|}
+        x y (color st)
+    else
+      Printf.bprintf b {|<circle cx="%.1f" cy="%.1f" r="4" fill="#%06x" fill-opacity="0.7"/>|}
+        x y (color st)
+  done;
+  Buffer.add_string b "</svg>";
+  Buffer.contents b
+
+(* A few paths made of many cubic curves *)
+let long_paths () =
+  let b = Buffer.create (1 lsl 20) in
+  let st = Random.State.make [| 2 |] in
+  header b ~w:1000 ~h:1000;
+  for _ = 1 to 8 do
+    Printf.bprintf b {|<path fill="#%06x" fill-opacity="0.5" d="M500 500|} (color st);
+    for _ = 1 to 6_000 do
+      let p () = Random.State.float st 1000. in
+      Printf.bprintf b " C%.1f %.1f %.1f %.1f %.1f %.1f" (p ()) (p ()) (p ()) (p ()) (p ()) (p ())
+    done;
+    Buffer.add_string b {|Z"/>|}
+  done;
+  Buffer.add_string b "</svg>";
+  Buffer.contents b
+
+(* Wide, dashed strokes with round joins and caps *)
+let heavy_strokes () =
+  let b = Buffer.create (1 lsl 20) in
+  let st = Random.State.make [| 3 |] in
+  header b ~w:1000 ~h:1000;
+  for i = 0 to 399 do
+    Printf.bprintf b {|<polyline fill="none" stroke="#%06x" stroke-width="%d" stroke-linejoin="%s" stroke-linecap="%s"|}
+      (color st) (2 + i mod 12)
+      (if i mod 2 = 0 then "round" else "miter")
+      (if i mod 3 = 0 then "round" else "square");
+    if i mod 2 = 1 then
+      Printf.bprintf b {| stroke-dasharray="%d %d"|} (4 + i mod 10) (3 + i mod 7);
+    Buffer.add_string b {| points="|};
+    for _ = 1 to 60 do
+      Printf.bprintf b "%.1f,%.1f " (Random.State.float st 1000.) (Random.State.float st 1000.)
+    done;
+    Buffer.add_string b {|"/>|}
+  done;
+  Buffer.add_string b "</svg>";
+  Buffer.contents b
+
+(* Shapes painted with many linear and radial gradients, some of which
+   inherit their stops from another one *)
+let many_gradients () =
+  let b = Buffer.create (1 lsl 20) in
+  let st = Random.State.make [| 4 |] in
+  let ngrads = 2_000 in
+  header b ~w:1000 ~h:1000;
+  Buffer.add_string b "<defs>";
+  for i = 0 to ngrads - 1 do
+    if i mod 4 = 3 then
+      Printf.bprintf b {|<linearGradient id="g%d" xlink:href="#g%d" x1="0" y1="0" x2="0" y2="1"/>|}
+        i (i - 1)
+    else begin
+      let kind = if i mod 2 = 0 then "linearGradient" else "radialGradient" in
+      Printf.bprintf b {|<%s id="g%d">|} kind i;
+      for k = 0 to 3 do
+        Printf.bprintf b {|<stop offset="%.2f" stop-color="#%06x"/>|} (float k /. 3.) (color st)
+      done;
+      Printf.bprintf b "</%s>" kind
+    end
+  done;
+  Buffer.add_string b "</defs>";
+  for _ = 0 to 9_999 do
+    Printf.bprintf b {|<rect x="%.1f" y="%.1f" width="30" height="20" fill="url(#g%d)"/>|}
+      (Random.State.float st 970.) (Random.State.float st 980.) (Random.State.int st ngrads)
+  done;
+  Buffer.add_string b "</svg>";
+  Buffer.contents b
+
+(* Many text elements of various sizes *)
+let large_text () =
+  let b = Buffer.create (1 lsl 20) in
+  let st = Random.State.make [| 5 |] in
+  let words = [| "nanosvg"; "rasterize"; "The quick brown fox"; "jumps over";
+                 "the lazy dog"; "0123456789"; "Lorem ipsum dolor sit amet" |] in
+  header b ~w:1000 ~h:1000;
+  for i = 0 to 1_999 do
+    Printf.bprintf b {|<text x="%.1f" y="%.1f" font-family="sans" font-size="%d" fill="#%06x"%s>%s</text>|}
+      (Random.State.float st 900.) (10. +. Random.State.float st 990.)
+      (8 + i mod 40) (color st)
+      (match i mod 3 with 0 -> "" | 1 -> {| text-anchor="middle"|} | _ -> {| text-anchor="end"|})
+      words.(i mod Array.length words)
+  done;
+  Buffer.add_string b "</svg>";
+  Buffer.contents b
+
+let generated = [
+  "many_shapes", many_shapes;
+  "long_paths", long_paths;
+  "heavy_strokes", heavy_strokes;
+  "many_gradients", many_gradients;
+  "large_text", large_text;
+]
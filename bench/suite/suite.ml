@@ -0,0 +1,277 @@
+(* Runs each operation of the library on a corpus of documents and reports
+   time, throughput, allocation and peak memory as JSON, so that results can
+   be recorded and compared between revisions.
+
+   Usage: suite.exe [--runs N] [--font FILE.ttf] [--output FILE]
+
+   The text rendering case needs a TrueType font; it is taken from --font or
+   from the NANOSVG_BENCH_FONT environment variable, and skipped if neither is
+   given. *)
+
+let runs = ref 5
+let font_file = ref (Sys.getenv_opt "NANOSVG_BENCH_FONT")
+let output = ref None
+
+let scales = [ 0.5; 1.; 2. ]
+
+(* Peak RSS. On Linux, writing 5 to clear_refs resets the high-water mark, so
+   that it can be measured per operation. *)
+
+let reset_peak_rss () =
+  try
+    let oc = open_out "/proc/self/clear_refs" in
+    Fun.protect ~finally:(fun () -> close_out_noerr oc)
+      (fun () -> output_string oc "5")
+  with Sys_error _ -> ()
+
+let peak_rss_kb () =
+  try
+    let ic = open_in "/proc/self/status" in
+    Fun.protect ~finally:(fun () -> close_in_noerr ic) (fun () ->
+      let rec loop () =
+        match input_line ic with
+        | line when String.length line > 6 && String.sub line 0 6 = "VmHWM:" ->
+          Scanf.sscanf (String.sub line 6 (String.length line - 6)) " %d" Option.some
+        | _ -> loop ()
+        | exception End_of_file -> None
+      in
+      loop ())
+  with Sys_error _ | Scanf.Scan_failure _ | Failure _ -> None
+
+(* Measurements *)
+
+type result = {
+  case : string;
+  op : string;
+  scale : float option;
+  time : float; (* seconds per run *)
+  throughput : (float * string) option; (* units per second *)
+  minor_words : float; (* per run *)
+  major_words : float; (* per run *)
+  peak_rss_kb : int option;
+}
+
+let results = ref []
+let skipped = ref []
+
+let measure ~case ~op ?scale ?work f =
+  ignore (Sys.opaque_identity (f ()));
+  Gc.full_major ();
+  reset_peak_rss ();
+  let g0 = Gc.quick_stat () in
+  let t0 = Sys.time () in
+  for _ = 1 to !runs do ignore (Sys.opaque_identity (f ())) done;
+  let time = (Sys.time () -. t0) /. float !runs in
+  let g1 = Gc.quick_stat () in
+  let per_run x = x /. float !runs in
+  let r = {
+    case; op; scale; time;
+    throughput =
+      Option.map (fun (n, unit) ->
+        (if time > 0. then n /. time else Float.infinity), unit) work;
+    minor_words = per_run (g1.minor_words -. g0.minor_words);
+    major_words = per_run (g1.major_words -. g0.major_words);
+    peak_rss_kb = peak_rss_kb ();
+  } in
+  results := r :: !results;
+  Printf.eprintf "%-16s %-16s %-5s %10.3fms\n%!" case op
+    (match scale with Some s -> Printf.sprintf "x%g" s | None -> "")
+    (time *. 1000.)
+
+let skip ~case ~op reason =
+  skipped := (case, op, reason) :: !skipped;
+  Printf.eprintf "%-16s %-16s skipped: %s\n%!" case op reason
+
+(* Fonts *)
+
+let load_font file =
+  let s = In_channel.with_open_bin file In_channel.input_all in
+  let buf = Bigarray.(Array1.create int8_unsigned c_layout (String.length s)) in
+  String.iteri (fun i c -> buf.{i} <- Char.code c) s;
+  match Stb_truetype.enum buf with
+  | [] -> None
+  | off :: _ -> Stb_truetype.init buf off
+
+(* Cases *)
+
+let temp_file name doc =
+  let file = Filename.temp_file ("nanosvg_" ^ name) ".svg" in
+  Out_channel.with_open_bin file (fun oc -> Out_channel.output_string oc doc);
+  at_exit (fun () -> try Sys.remove file with Sys_error _ -> ());
+  file
+
+let pixels img scale =
+  let w = int_of_float (Nanosvg.Image_data.width img *. scale) in
+  let h = int_of_float (Nanosvg.Image_data.height img *. scale) in
+  max w 1, max h 1
+
+let run_case ~font (case, file) =
+  let doc = In_channel.with_open_bin file In_channel.input_all in
+  let bytes = float (String.length doc) in
+  measure ~case ~op:"parse" ~work:(bytes, "bytes") (fun () -> Nanosvg.parse doc);
+  measure ~case ~op:"parse_from_file" ~work:(bytes, "bytes")
+    (fun () -> Nanosvg.parse_from_file file);
+  match Nanosvg.parse doc with
+  | None -> skip ~case ~op:"lift" "parse error"
+  | Some img ->
+    let nshapes = float (Nanosvg.Shape.fold (fun n _ -> n + 1) 0 img) in
+    measure ~case ~op:"lift" ~work:(nshapes, "shapes") (fun () -> Nanosvg.lift img);
+    measure ~case ~op:"index" ~work:(nshapes, "shapes") (fun () -> Nanosvg.Index.create img);
+    let index = Nanosvg.Index.create img in
+    let st = Random.State.make [| 6 |] in
+    let npicks = 1000 in
+    let picks = Array.init npicks (fun _ ->
+      Random.State.float st (Nanosvg.Image_data.width img),
+      Random.State.float st (Nanosvg.Image_data.height img)) in
+    measure ~case ~op:"pick" ~work:(float npicks, "picks") (fun () ->
+      Array.iter (fun (x, y) -> ignore (Nanosvg.Index.pick ~tolerance:1. index ~x ~y)) picks);
+    let r = Nanosvg.Rasterizer.create () in
+    let r_pre = Nanosvg.Rasterizer.(create ~format:Pixel_bgra_premultiplied ()) in
+    List.iter (fun scale ->
+      let w, h = pixels img scale in
+      let dst = Bigarray.(Array1.create int8_unsigned c_layout (w * h * 4)) in
+      measure ~case ~op:"rasterize" ~scale ~work:(float (w * h), "pixels")
+        (fun () -> Nanosvg.rasterize r img ~tx:0. ~ty:0. ~scale ~dst ~w ~h ());
+      measure ~case ~op:"rasterize_bgra_premultiplied" ~scale ~work:(float (w * h), "pixels")
+        (fun () -> Nanosvg.rasterize r_pre img ~tx:0. ~ty:0. ~scale ~dst ~w ~h ())
+    ) scales;
+    (* a few shapes change color on each frame *)
+    let w, h = pixels img 1. in
+    let target = Nanosvg.Target.create r img ~tx:0. ~ty:0. ~scale:1. ~w ~h in
+    ignore (Nanosvg.Target.update target);
+    let shapes = Array.of_list (Nanosvg.Shape.fold (fun l s -> s :: l) [] img) in
+    let frame = ref 0 in
+    measure ~case ~op:"target_update" ~scale:1. ~work:(1., "frames") (fun () ->
+      incr frame;
+      for k = 0 to 4 do
+        let s = shapes.((!frame * 7919 + k * 104729) mod Array.length shapes) in
+        Nanosvg.Shape.set_fill_color s (Int32.of_int (0xff000000 lor (!frame * 0x10101)))
+      done;
+      Nanosvg.Target.update target);
+    let lifted = Nanosvg.lift img in
+    let has_text =
+      List.exists (fun (s: Nanosvg.shape) ->
+        match s.payload with Nanosvg.Shape_text _ -> true | _ -> false)
+        lifted.shapes
+    in
+    if has_text then
+      match font with
+      | None -> skip ~case ~op:"rasterize_text" "no font (use --font)"
+      | Some font ->
+        let w, h = pixels img 1. in
+        let dst = Bigarray.(Array1.create int8_unsigned c_layout (w * h * 4)) in
+        measure ~case ~op:"rasterize_text" ~scale:1. ~work:(float (w * h), "pixels")
+          (fun () ->
+             Nanosvg_text.rasterize_text lifted ~get_font:(fun ~family:_ -> font)
+               ~dst ~scale:1. ~tx:0. ~ty:0. ~w ~h ());
+        (* re-rendering with a glyph cache kept between frames *)
+        let cache = Nanosvg_text.Glyph_cache.create () in
+        measure ~case ~op:"rasterize_text_cached" ~scale:1. ~work:(float (w * h), "pixels")
+          (fun () ->
+             Nanosvg_text.rasterize_text ~cache lifted ~get_font:(fun ~family:_ -> font)
+               ~dst ~scale:1. ~tx:0. ~ty:0. ~w ~h ())
+
+(* JSON output *)
+
+let json_string b s =
+  Buffer.add_char b '"';
+  String.iter (function
+    | '"' -> Buffer.add_string b "\\\""
+    | '\\' -> Buffer.add_string b "\\\\"
+    | c when Char.code c < 0x20 -> Printf.bprintf b "\\u%04x" (Char.code c)
+    | c -> Buffer.add_char b c) s;
+  Buffer.add_char b '"'
+
+let json_float b x =
+  if Float.is_finite x then Printf.bprintf b "%.17g" x
+  else Buffer.add_string b "null"
+
+let json_option f b = function
+  | None -> Buffer.add_string b "null"
+  | Some x -> f b x
+
+let json_result b r =
+  Buffer.add_string b "    {\"case\": ";
+  json_string b r.case;
+  Buffer.add_string b ", \"op\": ";
+  json_string b r.op;
+  Buffer.add_string b ", \"scale\": ";
+  json_option json_float b r.scale;
+  Buffer.add_string b ", \"time\": ";
+  json_float b r.time;
+  Buffer.add_string b ", \"throughput\": ";
+  json_option (fun b (x, unit) ->
+    Buffer.add_string b "{\"value\": ";
+    json_float b x;
+    Buffer.add_string b ", \"unit\": ";
+    json_string b (unit ^ "/s");
+    Buffer.add_char b '}') b r.throughput;
+  Buffer.add_string b ", \"minor_words\": ";
+  json_float b r.minor_words;
+  Buffer.add_string b ", \"major_words\": ";
+  json_float b r.major_words;
+  Buffer.add_string b ", \"peak_rss_kb\": ";
+  json_option (fun b -> Printf.bprintf b "%d") b r.peak_rss_kb;
+  Buffer.add_char b '}'
+
+let json_list b f l =
+  Buffer.add_string b "[\n";
+  List.iteri (fun i x ->
+    if i > 0 then Buffer.add_string b ",\n";
+    f b x) l;
+  Buffer.add_string b "\n  ]"
+
+let to_json () =
+  let b = Buffer.create 4096 in
+  Printf.bprintf b "{\n  \"ocaml_version\": ";
+  json_string b Sys.ocaml_version;
+  Printf.bprintf b ",\n  \"runs\": %d,\n  \"results\": " !runs;
+  json_list b json_result (List.rev !results);
+  Buffer.add_string b ",\n  \"skipped\": ";
+  json_list b (fun b (case, op, reason) ->
+    Buffer.add_string b "    {\"case\": ";
+    json_string b case;
+    Buffer.add_string b ", \"op\": ";
+    json_string b op;
+    Buffer.add_string b ", \"reason\": ";
+    json_string b reason;
+    Buffer.add_char b '}') (List.rev !skipped);
+  Buffer.add_string b ",\n  \"peak_rss_kb\": ";
+  (* the per-operation resets leave the high-water mark of the last one *)
+  json_option (fun b -> Printf.bprintf b "%d") b
+    (List.fold_left (fun acc r ->
+       match acc, r.peak_rss_kb with
+       | Some a, Some x -> Some (max a x)
+       | None, x | x, None -> x) None !results);
+  Buffer.add_string b "\n}\n";
+  Buffer.contents b
+
+let () =
+  let example = ref "example" in
+  Arg.parse [
+    "--runs", Arg.Set_int runs, "N number of timed runs of each operation (default 5)";
+    "--font", Arg.String (fun f -> font_file := Some f), "FILE TrueType font for the text case";
+    "--output", Arg.String (fun f -> output := Some f), "FILE write the JSON report to FILE instead of stdout";
+    "--examples", Arg.Set_string example, "DIR directory holding 23.svg and drawing.svg (default: example)";
+  ] (fun _ -> raise (Arg.Bad "unexpected argument")) "suite.exe [options]";
+  let font =
+    Option.bind !font_file (fun f ->
+      match load_font f with
+      | Some _ as font -> font
+      | None -> Printf.eprintf "%s: cannot load font\n%!" f; None)
+  in
+  let bundled =
+    List.filter_map (fun name ->
+      let file = Filename.concat !example name in
+      if Sys.file_exists file then Some (name, file)
+      else (skip ~case:name ~op:"parse" "file not found"; None))
+      [ "23.svg"; "drawing.svg" ]
+  in
+  let generated =
+    List.map (fun (name, gen) -> name, temp_file name (gen ())) Corpus.generated
+  in
+  List.iter (run_case ~font) (bundled @ generated);
+  let json = to_json () in
+  match !output with
+  | None -> print_string json
+  | Some file -> Out_channel.with_open_bin file (fun oc -> Out_channel.output_string oc json)
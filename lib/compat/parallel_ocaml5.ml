@@ -0,0 +1,82 @@
+(* [run fs] runs each of the functions in [fs] on its own domain (the first
+   one on the current domain), and waits for all of them to terminate.
+
+   The other domains are worker domains, which are spawned the first time
+   they are needed and then wait for more functions to run: spawning a domain
+   costs about as much as rendering a small image. Callers are expected to
+   pass functions that share their work, so that the job gets done even when
+   fewer workers than functions are available. *)
+
+type batch = {
+  mutable pending : int;
+  mutable error : exn option;
+}
+
+let mutex = Mutex.create ()
+let work_available = Condition.create ()
+let batch_done = Condition.create ()
+let jobs : ((unit -> unit) * batch) Queue.t = Queue.create ()
+let workers : unit Domain.t list ref = ref []
+let stopping = ref false
+
+(* Runs a job taken from the queue; called with [mutex] held, returns with it
+   held. *)
+let run_job () =
+  let (f, batch) = Queue.pop jobs in
+  Mutex.unlock mutex;
+  let res = try Ok (f ()) with e -> Error e in
+  Mutex.lock mutex;
+  (match res with
+   | Error e when batch.error = None -> batch.error <- Some e
+   | _ -> ());
+  batch.pending <- batch.pending - 1;
+  if batch.pending = 0 then Condition.broadcast batch_done
+
+let worker () =
+  Mutex.lock mutex;
+  while not (Queue.is_empty jobs && !stopping) do
+    if Queue.is_empty jobs then Condition.wait work_available mutex
+    else run_job ()
+  done;
+  Mutex.unlock mutex
+
+let () =
+  at_exit (fun () ->
+      Mutex.lock mutex;
+      stopping := true;
+      Condition.broadcast work_available;
+      let ws = !workers in
+      workers := [];
+      Mutex.unlock mutex;
+      List.iter Domain.join ws)
+
+(* Spawns workers until there are [n]; fewer workers are left if domains
+   cannot be spawned anymore. Called with [mutex] held. *)
+let grow n =
+  try
+    for _ = List.length !workers + 1 to n do
+      workers := Domain.spawn worker :: !workers
+    done
+  with Failure _ -> ()
+
+let run (fs : (unit -> unit) array) =
+  let n = Array.length fs in
+  if n > 0 then begin
+    let batch = { pending = n - 1; error = None } in
+    Mutex.lock mutex;
+    if not !stopping then grow (n - 1);
+    for i = 1 to n - 1 do Queue.push (fs.(i), batch) jobs done;
+    Condition.broadcast work_available;
+    Mutex.unlock mutex;
+    let res = try Ok (fs.(0) ()) with e -> Error e in
+    (* The jobs that no worker has started yet are run here. *)
+    Mutex.lock mutex;
+    while batch.pending > 0 do
+      if Queue.is_empty jobs then Condition.wait batch_done mutex
+      else run_job ()
+    done;
+    Mutex.unlock mutex;
+    match res, batch.error with
+    | Error e, _ | Ok (), Some e -> raise e
+    | Ok (), None -> ()
+  end
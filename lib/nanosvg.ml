@@ -377,25 +377,24 @@ module XMLEntities = struct
 end
 
 module Image_data = struct
-  type c_data
-  external delete_image_c_data : c_data -> unit = "caml_nsvg_delete_image_c_data"
+  (* custom block, freed by its finalizer *)
+  type t
 
-  (* block to allow attaching a finalizer *)
-  type t = { dat : c_data }
+  external width : t -> float = "caml_nsvg_image_width"
+  external height : t -> float = "caml_nsvg_image_height"
+  external viewXform : t -> float array = "caml_nsvg_image_viewXform"
 
-  let mk dat =
-    let img = { dat } in
-    Gc.finalise (fun img -> delete_image_c_data img.dat) img;
-    img
+  external to_bytes : t -> bytes = "caml_nsvg_image_to_bytes"
+  external of_bytes : bytes -> t option = "caml_nsvg_image_of_bytes"
 
-  external width_ : c_data -> float = "caml_nsvg_image_width"
-  let width { dat } = width_ dat
+  (* MUST match the fields of NSVGparseStats *)
+  type parse_stats = {
+    elements : int;
+    path_commands : int;
+    gradients : int;
+  }
 
-  external height_ : c_data -> float = "caml_nsvg_image_height"
-  let height { dat } = height_ dat
-
-  external viewXform_ : c_data -> float array = "caml_nsvg_image_viewXform"
-  let viewXform { dat } = viewXform_ dat
+  external parse_stats : t -> parse_stats option = "caml_nsvg_image_parse_stats"
 end
 
 type units = Px | Pt | Pc | Mm | Cm | In
@@ -408,47 +407,447 @@ let string_of_units = function
   | Cm -> "cm"
   | In -> "in"
 
-external parse_from_file_ : string -> string -> float -> Image_data.c_data option =
+external parse_from_file_ : string -> string -> float -> bool -> bool -> Image_data.t option =
   "caml_nsvg_parse_from_file"
 
-let parse_from_file ?(units = Px) ?(dpi = 96.) filename =
-  Option.map Image_data.mk @@
-  parse_from_file_ filename (string_of_units units) dpi
+let parse_from_file ?(units = Px) ?(dpi = 96.) ?(compact = false) ?(mmap = false) filename =
+  parse_from_file_ filename (string_of_units units) dpi mmap compact
 
-external parse_ : string -> string -> float -> Image_data.c_data option =
+external parse_ : string -> string -> float -> bool -> Image_data.t option =
   "caml_nsvg_parse"
 
-let parse ?(units = Px) ?(dpi = 96.) data =
-  Option.map Image_data.mk @@
-  parse_ data (string_of_units units) dpi
+let parse ?(units = Px) ?(dpi = 96.) ?(compact = false) data =
+  parse_ data (string_of_units units) dpi compact
+
+type bigstring = (char, Bigarray.int8_unsigned_elt, Bigarray.c_layout) Bigarray.Array1.t
+
+external parse_bigstring_ : bigstring -> string -> float -> bool -> bool -> Image_data.t option =
+  "caml_nsvg_parse_bigstring"
+
+let parse_bigstring ?(units = Px) ?(dpi = 96.) ?(compact = false) ?(in_place = false) data =
+  parse_bigstring_ data (string_of_units units) dpi in_place compact
+
+external lift_ : Image_data.t -> image = "caml_nsvg_lift"
+let lift img = XMLEntities.decode (lift_ img)
+
+module Bundle = struct
+  type raw
+  type t = { raw : raw; index : (string, int) Hashtbl.t }
+
+  (* The layout of bundles is described in nanosvg_stubs.c *)
+  let magic = "NSVGBNDL"
+  let version = 1l
+  let header_size = 16
+  let entry_size = 32
+
+  let align8 n = (n + 7) land (lnot 7)
+
+  let to_bytes entries =
+    let entries =
+      Array.of_list (List.map (fun (name, img) -> (name, Image_data.to_bytes img)) entries) in
+    let count = Array.length entries in
+    let names_off = header_size + count * entry_size in
+    let images_off =
+      Array.fold_left (fun off (name, _) -> off + String.length name) names_off entries in
+    let size =
+      Array.fold_left (fun off (_, data) -> align8 off + Bytes.length data) images_off entries in
+    let buf = Bytes.make size '\000' in
+    Bytes.blit_string magic 0 buf 0 8;
+    Bytes.set_int32_ne buf 8 version;
+    Bytes.set_int32_ne buf 12 (Int32.of_int count);
+    let set_int64 off n = Bytes.set_int64_ne buf off (Int64.of_int n) in
+    ignore @@ Array.fold_left (fun (i, name_off, off) (name, data) ->
+      let off = align8 off in
+      let entry = header_size + i * entry_size in
+      set_int64 entry name_off;
+      set_int64 (entry + 8) (String.length name);
+      set_int64 (entry + 16) off;
+      set_int64 (entry + 24) (Bytes.length data);
+      Bytes.blit_string name 0 buf name_off (String.length name);
+      Bytes.blit data 0 buf off (Bytes.length data);
+      (i + 1, name_off + String.length name, off + Bytes.length data)
+    ) (0, names_off, images_off) entries;
+    buf
+
+  let save filename entries =
+    let buf = to_bytes entries in
+    Out_channel.with_open_bin filename (fun oc -> Out_channel.output_bytes oc buf)
+
+  external load_ : string -> bool -> raw option = "caml_nsvg_bundle_load"
+  external length_ : raw -> int = "caml_nsvg_bundle_length"
+  external name_ : raw -> int -> string = "caml_nsvg_bundle_name"
+  external get_ : raw -> int -> Image_data.t = "caml_nsvg_bundle_get"
+
+  let load ?(mmap = false) filename =
+    match load_ filename mmap with
+    | None -> None
+    | Some raw ->
+      let n = length_ raw in
+      let index = Hashtbl.create n in
+      (* the first image of a given name wins *)
+      for i = n - 1 downto 0 do Hashtbl.replace index (name_ raw i) i done;
+      Some { raw; index }
+
+  let length b = length_ b.raw
+
+  let check fname b i =
+    if i < 0 || i >= length_ b.raw then
+      raise (Invalid_argument ("Nanosvg.Bundle." ^ fname ^ ": index out of bounds"))
+
+  let name b i = check "name" b i; name_ b.raw i
+  let get b i = check "get" b i; get_ b.raw i
+
+  let find b name =
+    Option.map (get_ b.raw) (Hashtbl.find_opt b.index name)
+end
+
+type points = (float, Bigarray.float32_elt, Bigarray.c_layout) Bigarray.Array1.t
+
+(* Shapes and paths are pointers inside a raw image; the image is kept in the
+   record so that it is not collected while they are in use. The stubs read
+   the pointer from the second field. *)
+type ptr
 
-external lift_ : Image_data.c_data -> image = "caml_nsvg_lift"
-let lift { Image_data.dat } = XMLEntities.decode (lift_ dat)
+module Path = struct
+  type t = { img : Image_data.t; ptr : ptr }
+
+  external points : t -> points = "caml_nsvg_path_points"
+
+  external npoints : t -> int = "caml_nsvg_path_npoints" [@@noalloc]
+  external x_ : t -> (int [@untagged]) -> (float [@unboxed])
+    = "caml_nsvg_path_x_bytecode" "caml_nsvg_path_x" [@@noalloc]
+  external y_ : t -> (int [@untagged]) -> (float [@unboxed])
+    = "caml_nsvg_path_y_bytecode" "caml_nsvg_path_y" [@@noalloc]
+
+  let x p i =
+    if i < 0 || i >= npoints p then invalid_arg "Nanosvg.Path.x";
+    x_ p i
+
+  let y p i =
+    if i < 0 || i >= npoints p then invalid_arg "Nanosvg.Path.y";
+    y_ p i
+
+  let iter_points f p =
+    for i = 0 to npoints p - 1 do f (x_ p i) (y_ p i) done
+
+  external closed : t -> bool = "caml_nsvg_path_closed" [@@noalloc]
+  external bounds : t -> box = "caml_nsvg_path_bounds"
+end
+
+module Shape = struct
+  type t = { img : Image_data.t; ptr : ptr }
+
+  external iter : (t -> unit) -> Image_data.t -> unit = "caml_nsvg_shape_iter"
+  let fold f acc img =
+    let acc = ref acc in
+    iter (fun s -> acc := f !acc s) img;
+    !acc
+
+  external id : t -> string = "caml_nsvg_shape_id"
+  external fill : t -> paint = "caml_nsvg_shape_fill"
+  external stroke : t -> paint = "caml_nsvg_shape_stroke"
+  external opacity : t -> float = "caml_nsvg_shape_opacity"
+  external stroke_width : t -> float = "caml_nsvg_shape_stroke_width"
+  external fill_rule : t -> fill_rule = "caml_nsvg_shape_fill_rule" [@@noalloc]
+  external visible : t -> bool = "caml_nsvg_shape_visible" [@@noalloc]
+  external bounds : t -> box = "caml_nsvg_shape_bounds"
+
+  external text_ : t -> text option = "caml_nsvg_shape_text"
+  let text s =
+    Option.map (fun (txt : text) ->
+      { txt with s = XMLEntities.decode_entities txt.s }
+    ) (text_ s)
+
+  external iter_paths : (Path.t -> unit) -> t -> unit = "caml_nsvg_shape_iter_paths"
+
+  external fill_contains : t -> x:float -> y:float -> bool
+    = "caml_nsvg_shape_fill_contains" [@@noalloc]
+  external stroke_contains_ : t -> float -> float -> float -> bool
+    = "caml_nsvg_shape_stroke_contains" [@@noalloc]
+  let stroke_contains ?(tolerance = 0.) s ~x ~y = stroke_contains_ s x y tolerance
+
+  let nth img n =
+    let exception Found of t in
+    if n < 0 then invalid_arg "Nanosvg.Shape.nth";
+    let i = ref 0 in
+    match iter (fun s -> if !i = n then raise (Found s); incr i) img with
+    | () -> invalid_arg "Nanosvg.Shape.nth"
+    | exception Found s -> s
+
+  let find_all img name =
+    List.rev (fold (fun acc s -> if id s = name then s :: acc else acc) [] img)
+
+  external set_fill_color : t -> Int32.t -> unit = "caml_nsvg_shape_set_fill_color"
+  external set_stroke_color : t -> Int32.t -> unit = "caml_nsvg_shape_set_stroke_color"
+  external set_opacity : t -> float -> unit = "caml_nsvg_shape_set_opacity"
+  external set_visible : t -> bool -> unit = "caml_nsvg_shape_set_visible"
+end
 
 module Rasterizer = struct
   type raw
-  type t = { raw : raw }
+
+  (* MUST match enum NSVGpixelFormat *)
+  type pixel_format =
+    | Pixel_rgba
+    | Pixel_rgba_premultiplied
+    | Pixel_bgra
+    | Pixel_bgra_premultiplied
+    | Pixel_a8
+
+  (* [raw] MUST be the first field, the stubs only read that one *)
+  type t = { raw : raw; format : pixel_format; composite : bool }
   external delete : raw -> unit = "caml_nsvg_delete_rasterizer" [@@noalloc]
 
-  external create : unit -> raw = "caml_nsvg_create_rasterizer" [@@noalloc]
-  let create () =
-    let rast = { raw = create () } in
+  (* MUST match enum NSVGedgeEngine *)
+  type edge_engine = Edge_engine_classic | Edge_engine_radix
+
+  external create : bool -> edge_engine -> pixel_format -> bool -> raw
+    = "caml_nsvg_create_rasterizer" [@@noalloc]
+  let create ?(simd = true) ?(edge_engine = Edge_engine_classic)
+      ?(format = Pixel_rgba) ?(composite = false) () =
+    let rast = { raw = create simd edge_engine format composite; format; composite } in
     Gc.finalise (fun r -> delete r.raw) rast;
     rast
+
+  let format r = r.format
+  let composite r = r.composite
+  let bytes_per_pixel r =
+    match r.format with
+    | Pixel_a8 -> 1
+    | Pixel_rgba | Pixel_rgba_premultiplied | Pixel_bgra | Pixel_bgra_premultiplied -> 4
+
+  (* Built in caml_nsvg_rasterizer_stats *)
+  type stats = {
+    shape_edges : int array;
+    edges : int;
+    max_active_edges : int;
+    scanlines : int;
+    pixels : int;
+    pages : int;
+    edge_bytes : int;
+    point_bytes : int;
+    flatten_time : float;
+    stroke_time : float;
+    sort_time : float;
+    scanline_time : float;
+  }
+
+  external stats : t -> stats option = "caml_nsvg_rasterizer_stats"
 end
 
 type data8 = (int, Bigarray.int8_unsigned_elt, Bigarray.c_layout) Bigarray.Array1.t
 
 external rasterize_ :
-  Rasterizer.raw -> Image_data.c_data ->
+  Rasterizer.t -> Image_data.t ->
   float -> float -> float ->
   data8 -> int -> int -> int ->
+  int -> int -> int -> int ->
   unit
-  = "caml_nsvg_rasterize_bytecode" "caml_nsvg_rasterize_native" [@@noalloc]
+  = "caml_nsvg_rasterize_bytecode" "caml_nsvg_rasterize_native"
 
-let rasterize (t: Rasterizer.t) { Image_data.dat } ~tx ~ty ~scale ~dst ~w ~h ?(stride = w * 4) () =
-  if stride < w * 4 then
-    raise (Invalid_argument "Nanosvg.Rasterizer.rasterize: invalid stride (too small)");
+let check_dst fname r ~dst ~w ~h ~stride =
+  if stride < w * Rasterizer.bytes_per_pixel r then
+    raise (Invalid_argument ("Nanosvg." ^ fname ^ ": invalid stride (too small)"));
   if Bigarray.Array1.size_in_bytes dst < h * stride then
-    raise (Invalid_argument "Nanosvg.Rasterizer.rasterize: destination buffer too small");
-  rasterize_ t.raw dat tx ty scale dst w h stride
+    raise (Invalid_argument ("Nanosvg." ^ fname ^ ": destination buffer too small"))
+
+let rasterize (t: Rasterizer.t) img ~tx ~ty ~scale ~dst ~w ~h
+    ?(stride = w * Rasterizer.bytes_per_pixel t) () =
+  check_dst "Rasterizer.rasterize" t ~dst ~w ~h ~stride;
+  rasterize_ t img tx ty scale dst w h stride 0 0 w h
+
+(* pixels (partially) covered by the region, clamped to the destination *)
+let region_pixels ~region ~tx ~ty ~scale ~w ~h =
+  let px v n = int_of_float (Float.min (float n) (Float.max 0. v)) in
+  let x0 = px (Float.floor (region.minx *. scale +. tx)) w in
+  let y0 = px (Float.floor (region.miny *. scale +. ty)) h in
+  let x1 = px (Float.ceil (region.maxx *. scale +. tx)) w in
+  let y1 = px (Float.ceil (region.maxy *. scale +. ty)) h in
+  (x0, y0, x1, y1)
+
+let rasterize_region (t: Rasterizer.t) img ~region ~tx ~ty ~scale ~dst ~w ~h
+    ?(stride = w * Rasterizer.bytes_per_pixel t) () =
+  check_dst "rasterize_region" t ~dst ~w ~h ~stride;
+  let (x0, y0, x1, y1) = region_pixels ~region ~tx ~ty ~scale ~w ~h in
+  rasterize_ t img tx ty scale dst w h stride x0 y0 x1 y1
+
+module Prepared = struct
+  type raw
+  (* [img] is kept alive for as long as [raw] points into it. The edges and
+     paints of [raw] are those of [img] at [generation]. *)
+  type t = { img : Image_data.t; raw : raw; scale : float; generation : int }
+
+  external prepare : Rasterizer.t -> Image_data.t -> float -> raw = "caml_nsvg_prepare"
+  external generation : Image_data.t -> int = "caml_nsvg_image_generation" [@@noalloc]
+
+  let create (r: Rasterizer.t) img ~scale =
+    { img; raw = prepare r img scale; scale; generation = generation img }
+
+  let image p = p.img
+  let scale p = p.scale
+
+  let check fname p =
+    if generation p.img <> p.generation then
+      raise (Invalid_argument ("Nanosvg." ^ fname ^ ": the image changed since it was prepared"))
+end
+
+external rasterize_prepared_ :
+  Rasterizer.t -> Prepared.t ->
+  float -> float ->
+  data8 -> int -> int -> int ->
+  int -> int -> int -> int ->
+  unit
+  = "caml_nsvg_rasterize_prepared_bytecode" "caml_nsvg_rasterize_prepared_native"
+
+let rasterize_prepared (t: Rasterizer.t) (p: Prepared.t) ~tx ~ty ~dst ~w ~h
+    ?(stride = w * Rasterizer.bytes_per_pixel t) () =
+  check_dst "rasterize_prepared" t ~dst ~w ~h ~stride;
+  Prepared.check "rasterize_prepared" p;
+  rasterize_prepared_ t p tx ty dst w h stride 0 0 w h
+
+let rasterize_prepared_region (t: Rasterizer.t) (p: Prepared.t) ~region ~tx ~ty
+    ~dst ~w ~h ?(stride = w * Rasterizer.bytes_per_pixel t) () =
+  check_dst "rasterize_prepared_region" t ~dst ~w ~h ~stride;
+  Prepared.check "rasterize_prepared_region" p;
+  let (x0, y0, x1, y1) =
+    region_pixels ~region ~tx ~ty ~scale:p.scale ~w ~h in
+  rasterize_prepared_ t p tx ty dst w h stride x0 y0 x1 y1
+
+external finish_ : Rasterizer.t -> data8 -> int -> int -> int -> unit
+  = "caml_nsvg_finish"
+
+external prepare_region_ :
+  Rasterizer.t -> Image_data.t -> float -> float -> float -> int -> int -> Prepared.raw
+  = "caml_nsvg_prepare_region_bytecode" "caml_nsvg_prepare_region_native"
+
+external rasterize_prepared_unfinished_ :
+  Rasterizer.t -> Prepared.t ->
+  float -> float ->
+  data8 -> int -> int -> int ->
+  int -> int -> int -> int ->
+  unit
+  = "caml_nsvg_rasterize_prepared_unfinished_bytecode"
+    "caml_nsvg_rasterize_prepared_unfinished_native"
+
+(* The shapes are flattened once, by the current domain, into a prepared image
+   that all the workers draw from. The output is split in horizontal bands,
+   which are handed out to the workers through a shared counter. Each band is
+   drawn as a region of [dst], and left premultiplied: transparent pixels take
+   their color from their neighbours, which may be in another band, so the
+   image is only finished once all the bands are drawn. *)
+let rasterize_parallel (rasts: Rasterizer.t array) img ~tx ~ty ~scale ~dst ~w ~h
+    ?stride ?bands () =
+  let n = Array.length rasts in
+  if n = 0 then
+    raise (Invalid_argument "Nanosvg.rasterize_parallel: no rasterizers");
+  let r0 = rasts.(0) in
+  if Array.exists (fun r ->
+      Rasterizer.format r <> Rasterizer.format r0
+      || Rasterizer.composite r <> Rasterizer.composite r0) rasts then
+    raise (Invalid_argument "Nanosvg.rasterize_parallel: rasterizers with different outputs");
+  for i = 0 to n - 1 do
+    for j = i + 1 to n - 1 do
+      if rasts.(i).Rasterizer.raw == rasts.(j).Rasterizer.raw then
+        raise (Invalid_argument "Nanosvg.rasterize_parallel: the same rasterizer is given twice")
+    done
+  done;
+  let stride =
+    match stride with
+    | Some s -> s
+    | None -> w * Rasterizer.bytes_per_pixel r0
+  in
+  check_dst "rasterize_parallel" r0 ~dst ~w ~h ~stride;
+  let bands =
+    match bands with
+    | Some n -> n
+    | None -> 4 * n
+  in
+  let bands = max 1 (min bands h) in
+  let band_h = (h + bands - 1) / bands in
+  let p = { Prepared.img; raw = prepare_region_ r0 img tx ty scale w h; scale;
+            generation = Prepared.generation img } in
+  let next = Atomic.make 0 in
+  let rec work rast () =
+    let y0 = Atomic.fetch_and_add next 1 * band_h in
+    if y0 < h then begin
+      let y1 = min h (y0 + band_h) in
+      rasterize_prepared_unfinished_ rast p tx ty dst w h stride 0 y0 w y1;
+      work rast ()
+    end
+  in
+  Parallel.run (Array.map work rasts);
+  finish_ r0 dst w h stride
+
+module Index = struct
+  type raw
+  (* [img] is kept alive for as long as [raw] points into it *)
+  type t = { img : Image_data.t; raw : raw }
+
+  external create_ : Image_data.t -> raw = "caml_nsvg_index_create"
+  let create img = { img; raw = create_ img }
+
+  let image i = i.img
+
+  external length : t -> int = "caml_nsvg_index_length" [@@noalloc]
+  external shape : t -> int -> Shape.t = "caml_nsvg_index_shape"
+  external query : t -> box -> int array = "caml_nsvg_index_query_rect"
+
+  external hits_ : t -> float -> float -> float -> int array = "caml_nsvg_index_query_point"
+  let hits ?(tolerance = 0.) i ~x ~y = hits_ i x y tolerance
+
+  external pick_ : t -> float -> float -> float -> int = "caml_nsvg_index_pick" [@@noalloc]
+  let pick ?(tolerance = 0.) i ~x ~y =
+    match pick_ i x y tolerance with
+    | -1 -> None
+    | n -> Some n
+end
+
+module Target = struct
+  type t = {
+    rast : Rasterizer.t;
+    img : Image_data.t;
+    tx : float; ty : float; scale : float;
+    w : int; h : int;
+    dst : data8;
+    mutable generation : int; (* of [img] when last drawn; -1 if never *)
+  }
+
+  external generation : Image_data.t -> int = "caml_nsvg_image_generation" [@@noalloc]
+  external changes_since : Image_data.t -> int -> box option = "caml_nsvg_image_changes_since"
+
+  let create rast img ~tx ~ty ~scale ~w ~h =
+    if Rasterizer.composite rast then
+      raise (Invalid_argument "Nanosvg.Target.create: compositing rasterizer");
+    let size = w * h * Rasterizer.bytes_per_pixel rast in
+    let dst = Bigarray.(Array1.create int8_unsigned c_layout size) in
+    { rast; img; tx; ty; scale; w; h; dst; generation = -1 }
+
+  let image t = t.img
+  let pixels t = t.dst
+  let invalidate t = t.generation <- -1
+
+  let update t =
+    let gen = generation t.img in
+    if t.generation = gen then None
+    else begin
+      let changes = if t.generation < 0 then None else changes_since t.img t.generation in
+      t.generation <- gen;
+      let (x0, y0, x1, y1) =
+        match changes with
+        | None -> (0, 0, t.w, t.h)
+        | Some region ->
+          (* one pixel around the shapes for antialiasing, and one more for
+             the transparent pixels whose color comes from their neighbours *)
+          let pad = 2. /. t.scale in
+          let region = { minx = region.minx -. pad; miny = region.miny -. pad;
+                         maxx = region.maxx +. pad; maxy = region.maxy +. pad } in
+          region_pixels ~region ~tx:t.tx ~ty:t.ty ~scale:t.scale ~w:t.w ~h:t.h
+      in
+      if x0 >= x1 || y0 >= y1 then None
+      else begin
+        let stride = t.w * Rasterizer.bytes_per_pixel t.rast in
+        rasterize_ t.rast t.img t.tx t.ty t.scale t.dst t.w t.h stride x0 y0 x1 y1;
+        Some (x0, y0, x1, y1)
+      end
+    end
+end
@@ -3,12 +3,41 @@
 (** Raw images of type {!Image_data.t} are the direct result of parsing SVG
     data. They cannot be inspected directly from OCaml (except for their size
     and viewbox), but can be fed as-is to the rasterize function. The {!lift}
-    function allows to convert from a raw image into an inspectable SVG image.*)
+    function allows to convert from a raw image into an inspectable SVG image.
+
+    A raw image is held in a few large blocks of C memory (a single one if it
+    was parsed with [~compact:true]), whose size is reported to the GC, and
+    which are freed at once when the image is collected. *)
 module Image_data : sig
   type t
   val width : t -> float
   val height : t -> float
   val viewXform : t -> float array
+
+  (** [to_bytes img] serializes [img] into a compact binary form, which
+      {!of_bytes} loads without parsing SVG again. The serialized form depends
+      on the version of this library and on the platform (pointer size and
+      byte order); it is meant as a cache, not as an interchange format. *)
+  val to_bytes : t -> bytes
+
+  (** [of_bytes b] loads an image serialized by {!to_bytes}. The image is
+      checked against a checksum, then usable right away. Returns [None] if
+      [b] is corrupted or was written by another version of this library or
+      on another platform. *)
+  val of_bytes : bytes -> t option
+
+  (** Counters describing the work done by the parser. *)
+  type parse_stats = {
+    elements : int; (** XML elements *)
+    path_commands : int; (** path commands, counting implicitly repeated ones *)
+    gradients : int; (** gradient definitions *)
+  }
+
+  (** [parse_stats img] are the counters of the parse that produced [img].
+      They are only collected if the library is built with profiling enabled
+      (see {!Rasterizer.stats}); [None] is returned otherwise, or if [img] was
+      not parsed (e.g. loaded by {!of_bytes}). *)
+  val parse_stats : t -> parse_stats option
 end
 
 (** {1 SVG images} *)
@@ -109,42 +138,297 @@ type image = {
 
 type units = Px | Pt | Pc | Mm | Cm | In
 
-(** [parse ~units ~dpi s] parses [s] as SVG data.
+(** [parse ~units ~dpi ~compact s] parses [s] as SVG data.
     - [units] indicates the unit that should be used for the paths' coordinates and dimensions.
     - [dpi] controls how the unit conversion is done.
+    - [compact]: if [true], the parsed image is copied into a single block of
+      memory, in the order in which it is rendered, and the blocks allocated
+      by the parser are freed. Until they are, the image takes twice its size
+      in memory. If [false], or if the copy cannot be allocated, the image is
+      kept as parsed.
 
-    By default, [units] is [Px] and [dpi] is [96].
+    By default, [units] is [Px], [dpi] is [96] and [compact] is [false].
 *)
-val parse : ?units:units -> ?dpi:float -> string -> Image_data.t option
+val parse : ?units:units -> ?dpi:float -> ?compact:bool -> string -> Image_data.t option
 
 (** [parse_from_file fn] parses the contents of the file named [fn] as SVG data.
-    See {!parse} for the description of the optional arguments. *)
-val parse_from_file : ?units:units -> ?dpi:float -> string -> Image_data.t option
+    See {!parse} for the description of the optional arguments.
+
+    If [mmap] is [true] (default: [false]), the file is mapped in memory and
+    parsed in place instead of being read into a buffer. The file itself is
+    not modified. [mmap] is ignored on Windows. *)
+val parse_from_file :
+  ?units:units -> ?dpi:float -> ?compact:bool -> ?mmap:bool -> string -> Image_data.t option
+
+type bigstring = (char, Bigarray.int8_unsigned_elt, Bigarray.c_layout) Bigarray.Array1.t
+
+(** [parse_bigstring buf] parses the contents of [buf] as SVG data. The buffer
+    does not need to be NUL-terminated. See {!parse} for the description of
+    the optional arguments.
+
+    The parser writes into its input. By default, [buf] is copied into a
+    scratch buffer that is reused across calls (buffers over 1 MB are freed
+    after use instead). If [in_place] is [true], [buf] is parsed directly,
+    which saves a copy but leaves its contents unspecified. *)
+val parse_bigstring :
+  ?units:units -> ?dpi:float -> ?compact:bool -> ?in_place:bool -> bigstring ->
+  Image_data.t option
 
 (** [lift img] converts the raw image [img] into its ocaml representation. *)
 val lift : Image_data.t -> image
 
+(** {1 Bundles}
+
+    A bundle is a file holding many serialized images (see
+    {!Image_data.to_bytes}), each with a name. Loading a bundle reads or maps
+    the file, checks and relocates all of its images, and does not parse any
+    SVG: it is meant to cache sets of images (icons, ...) that are loaded at
+    each startup. Like serialized images, bundles can only be loaded by the
+    same version of this library, on the same platform. *)
+module Bundle : sig
+  type t
+
+  (** [to_bytes entries] is the contents of a bundle holding the images of
+      [entries], with their names, in order. *)
+  val to_bytes : (string * Image_data.t) list -> bytes
+
+  (** [save fn entries] writes the bundle [to_bytes entries] to the file named
+      [fn]. *)
+  val save : string -> (string * Image_data.t) list -> unit
+
+  (** [load fn] loads the bundle in the file named [fn]. Returns [None] if the
+      file cannot be read, or does not hold a valid bundle.
+
+      If [mmap] is [true] (default: [false]), the file is mapped in memory
+      and the images are used in place: only the pages that hold pointers are
+      copied. The file itself is not modified. [mmap] is ignored on Windows.
+
+      The images of a bundle share its memory, which is released once the
+      bundle and all the images taken from it are collected. *)
+  val load : ?mmap:bool -> string -> t option
+
+  (** Number of images in the bundle. *)
+  val length : t -> int
+
+  (** [name b i] is the name of the [i]-th image of [b].
+      @raise Invalid_argument if [i] is out of bounds. *)
+  val name : t -> int -> string
+
+  (** [get b i] is the [i]-th image of [b].
+      @raise Invalid_argument if [i] is out of bounds. *)
+  val get : t -> int -> Image_data.t
+
+  (** [find b name] is the first image of [b] named [name], if any. *)
+  val find : t -> string -> Image_data.t option
+end
+
+(** {1 Lazy inspection}
+
+    Unlike {!lift}, which copies a whole raw image into OCaml values, the
+    {!Shape} and {!Path} modules read the fields of a raw image on demand. A
+    shape or a path keeps its image alive. *)
+
+(** Points of a path, as a flat array of coordinates: x0,y0,
+    \[cpx1,cpy1,cpx2,cpy2,x1,y1\], ... *)
+type points = (float, Bigarray.float32_elt, Bigarray.c_layout) Bigarray.Array1.t
+
+module Path : sig
+  type t
+
+  (** [points p] is a copy of the points of [p]. *)
+  val points : t -> points
+
+  (** [npoints p] is the number of points of [p], half the length of
+      [points p]. *)
+  val npoints : t -> int
+
+  (** [x p i] and [y p i] are the coordinates of the [i]-th point of [p]. They
+      read the image in place and do not allocate in native code.
+      @raise Invalid_argument if [i] is not in [0 .. npoints p - 1]. *)
+  val x : t -> int -> float
+  val y : t -> int -> float
+
+  (** [iter_points f p] calls [f x y] on each point of [p], in order, without
+      copying them. *)
+  val iter_points : (float -> float -> unit) -> t -> unit
+
+  val closed : t -> bool
+  val bounds : t -> box
+end
+
+module Shape : sig
+  type t
+
+  (** [iter f img] calls [f] on each shape of [img], in order. *)
+  val iter : (t -> unit) -> Image_data.t -> unit
+  val fold : ('a -> t -> 'a) -> 'a -> Image_data.t -> 'a
+
+  val id : t -> string
+  val fill : t -> paint
+  val stroke : t -> paint
+  val opacity : t -> float
+  val stroke_width : t -> float
+  val fill_rule : t -> fill_rule
+  val visible : t -> bool
+  val bounds : t -> box
+
+  (** [text s] is the text element of [s], if [s] is a text shape. XML
+      entities are decoded. *)
+  val text : t -> text option
+
+  (** [iter_paths f s] calls [f] on each path of [s]. There are none for text
+      shapes. *)
+  val iter_paths : (Path.t -> unit) -> t -> unit
+
+  (** [fill_contains s ~x ~y] tells whether the point [(x, y)] is inside the
+      paths of [s] according to its fill rule, whatever its fill paint. Open
+      paths are closed by a straight line, as when rendering. *)
+  val fill_contains : t -> x:float -> y:float -> bool
+
+  (** [stroke_contains ?tolerance s ~x ~y] tells whether the point [(x, y)] is
+      at most [stroke_width s /. 2. +. tolerance] away from the paths of [s]
+      (default [tolerance]: 0). Joins and caps are taken as round, and dashes
+      are ignored. *)
+  val stroke_contains : ?tolerance:float -> t -> x:float -> y:float -> bool
+
+  (** [nth img n] is the [n]-th shape of [img], in the order of {!iter}. It
+      goes through the shapes before it; {!Index.shape} does not.
+      @raise Invalid_argument if [n] is out of bounds. *)
+  val nth : Image_data.t -> int -> t
+
+  (** [find_all img name] are the shapes of [img] whose {!id} is [name], in
+      order. Shapes inherit the id of their group, so there may be several. *)
+  val find_all : Image_data.t -> string -> t list
+
+  (** {2 Changing shapes}
+
+      These functions change the raw image of a shape in place: images taken
+      from it afterwards by {!lift}, {!Image_data.to_bytes} or rasterizing see
+      the change, and {!Target}s redraw the area of the shape. Shapes are
+      best looked up once and kept, as a shape keeps its image alive.
+
+      An image must not be changed while it is being rasterized by another
+      thread or domain, and {!Prepared} images made before a change can no
+      longer be rendered. Images taken from a {!Bundle} by {!Bundle.get} share their
+      shapes, and the record of their changes, with the other images taken
+      from the same entry: a {!Target} built on one of them redraws the shapes
+      changed through another. *)
+
+  (** [set_fill_color s c] paints the inside of [s] with the color [c]
+      (same format as [Paint_color]), replacing its previous fill paint. *)
+  val set_fill_color : t -> Int32.t -> unit
+
+  (** [set_stroke_color s c] is {!set_fill_color} for the stroke paint. The
+      stroke is drawn with the existing stroke width. *)
+  val set_stroke_color : t -> Int32.t -> unit
+
+  val set_opacity : t -> float -> unit
+  val set_visible : t -> bool -> unit
+end
+
 (** {1 Rasterization} *)
 
 (** A {!Rasterizer.t} is a handle to an opaque rasterizer context. Reusing the
     same rasterizer context accross multiple calls to {!rasterize} is more
     efficient than recreating a new context each time.
+
+    The OCaml runtime lock is released while parsing and rasterizing, so other
+    threads and domains keep running in the meantime. A raw image can be
+    rasterized by several threads or domains at the same time, but a given
+    rasterizer context must only be used by one of them at a time.
 *)
 module Rasterizer : sig
   type t
-  val create : unit -> t
+
+  (** Algorithms turning the edges of a shape into pixel coverage. Both give
+      the same pixels.
+      - [Edge_engine_classic] sorts the edges with [qsort] and keeps the edges
+        crossing the current scanline in a linked list, which is sorted again
+        on each sub-scanline.
+      - [Edge_engine_radix] buckets the edges by their starting scanline and
+        keeps the edges crossing the current scanline in an array. It is
+        faster on drawings with many edges per shape (maps, CAD drawings). *)
+  type edge_engine = Edge_engine_classic | Edge_engine_radix
+
+  (** Pixel formats of the rendered images.
+      - [Pixel_rgba], [Pixel_bgra]: 4 bytes per pixel, non-premultiplied
+        alpha.
+      - [Pixel_rgba_premultiplied], [Pixel_bgra_premultiplied]: 4 bytes per
+        pixel, premultiplied alpha. Pixels are composited in that format, so
+        rendering to it saves a pass over the drawn pixels.
+      - [Pixel_a8]: 1 byte per pixel, alpha only (a coverage mask). *)
+  type pixel_format =
+    | Pixel_rgba
+    | Pixel_rgba_premultiplied
+    | Pixel_bgra
+    | Pixel_bgra_premultiplied
+    | Pixel_a8
+
+  (** [create ?simd ?edge_engine ?format ?composite ()] creates a rasterizer
+      context.
+      - If [simd] is [true] (the default), pixels are composited using the
+        vector instructions (SSE2, AVX2 or NEON) available on the CPU;
+        otherwise, the scalar reference code is used. Both give the same
+        pixels.
+      - [edge_engine] selects the edge engine (default:
+        [Edge_engine_classic]).
+      - [format] is the pixel format of the images it renders (default:
+        [Pixel_rgba]).
+      - If [composite] is [true], images are drawn over the contents of the
+        destination, which must be in the same format; otherwise (the
+        default), the destination is cleared first. With the non-premultiplied
+        formats, each pixel covered by a shape is blended in that format by
+        the scalar code, and the other pixels are left untouched. *)
+  val create :
+    ?simd:bool -> ?edge_engine:edge_engine ->
+    ?format:pixel_format -> ?composite:bool ->
+    unit -> t
+
+  val format : t -> pixel_format
+  val composite : t -> bool
+
+  (** Size of a pixel in the images rendered by the rasterizer: 1 for
+      [Pixel_a8], 4 otherwise. *)
+  val bytes_per_pixel : t -> int
+
+  (** Counters describing the work done by the last rendering of a rasterizer
+      context. Times are in seconds. *)
+  type stats = {
+    shape_edges : int array; (** edges of each shape drawn (fill and stroke) *)
+    edges : int; (** edges drawn, in total *)
+    max_active_edges : int; (** peak number of edges crossing a scanline *)
+    scanlines : int; (** scanlines swept *)
+    pixels : int; (** pixels composited *)
+    pages : int; (** memory pages allocated for active edges *)
+    edge_bytes : int; (** bytes reallocated for the edge buffers *)
+    point_bytes : int; (** bytes reallocated for the point buffers *)
+    flatten_time : float; (** time spent flattening fills into edges *)
+    stroke_time : float; (** time spent flattening strokes into edges *)
+    sort_time : float; (** time spent sorting edges *)
+    scanline_time : float; (** time spent sweeping scanlines and compositing *)
+  }
+
+  (** [stats r] are the counters of the last call to a rendering function
+      with [r]. The counters are only collected if the library is built with
+      profiling enabled, by setting [NANOSVG_CFLAGS=-DNSVG_PROFILE] in the
+      environment of [dune build]; they cost nothing otherwise, and [stats]
+      returns [None]. *)
+  val stats : t -> stats option
 end
 
 type data8 = (int, Bigarray.int8_unsigned_elt, Bigarray.c_layout) Bigarray.Array1.t
 
 (** [rasterize r img ~tx ~ty ~scale ~dst ~w ~h ?stride ()] rasterizes a raw SVG
-    image [img] by writing RGBA pixels (non-premultiplied alpha) to [dst].
+    image [img] by writing pixels to [dst], in the format of [r] (RGBA with
+    non-premultiplied alpha by default).
+    Shapes that fall outside of the destination image are skipped.
     - [tx], [ty]: image offset (applied after scaling)
     - [scale]: image scale
-    - [dst]: buffer for the destination image data, 4 bytes per pixel (RGBA)
+    - [dst]: buffer for the destination image data, [Rasterizer.bytes_per_pixel r]
+      bytes per pixel
     - [w], [h]: width, height of the image to render
     - [stride]: number of bytes per scaleline in the destination buffer.
-      It is [w*4] by default.
+      It is [w * Rasterizer.bytes_per_pixel r] by default.
 *)
 val rasterize :
   Rasterizer.t -> Image_data.t ->
@@ -152,3 +436,186 @@ val rasterize :
   dst:data8 -> w:int -> h:int -> ?stride:int ->
   unit ->
   unit
+
+(** [rasterize_region r img ~region ~tx ~ty ~scale ~dst ~w ~h ?stride ()] is
+    like {!rasterize}, except that only the part of [img] inside [region] is
+    drawn. [region] is given in the coordinates of [img] (before scaling and
+    translation). Pixels of [dst] that are outside of the transformed region
+    are left untouched, and shapes that do not intersect it are skipped
+    altogether. Pixels inside the region are the same as with {!rasterize}
+    if the pixels around it also are (transparent pixels take their color
+    from their neighbours).
+
+    For instance, a 256x256 tile whose top-left corner is at [(x, y)] in
+    the coordinates of [img] is rendered with
+    [~region:{minx = x; miny = y; maxx = x +. 256. /. scale; maxy = y +. 256. /. scale}
+     ~tx:(-. x *. scale) ~ty:(-. y *. scale) ~w:256 ~h:256].
+*)
+val rasterize_region :
+  Rasterizer.t -> Image_data.t ->
+  region:box ->
+  tx:float -> ty:float -> scale:float ->
+  dst:data8 -> w:int -> h:int -> ?stride:int ->
+  unit ->
+  unit
+
+(** [rasterize_parallel rs img ~tx ~ty ~scale ~dst ~w ~h ?stride ?bands ()]
+    has the same result as {!rasterize}, but splits the output in horizontal
+    bands that are rendered in parallel, one domain per rasterizer context of
+    [rs]. Each band is rendered using one of the rasterizers of [rs]; they must
+    not be used by another thread or domain during the call. The shapes are
+    first flattened once, on the current domain, like {!Prepared.create}
+    does, and the bands are drawn from the prepared image.
+    - [bands]: number of bands the output is split into. It is
+      [4 * Array.length rs] by default.
+
+    The domains other than the current one are taken from a pool of worker
+    domains, which are spawned on the first call that needs them and kept for
+    the following calls. On OCaml versions without domains, the bands are
+    rendered sequentially using the first rasterizer of [rs].
+
+    @raise Invalid_argument if [rs] is empty, if it contains the same
+    rasterizer twice, or if its rasterizers do not have the same format and
+    compositing mode.
+*)
+val rasterize_parallel :
+  Rasterizer.t array -> Image_data.t ->
+  tx:float -> ty:float -> scale:float ->
+  dst:data8 -> w:int -> h:int -> ?stride:int -> ?bands:int ->
+  unit ->
+  unit
+
+(** {2 Prepared images}
+
+    Rendering an image flattens its curves and strokes into edges at the
+    requested scale, then draws the edges. When the same image is rendered
+    many times at the same scale (icons at fixed sizes, animation frames that
+    only move the image), the first step can be done once and for all by
+    preparing the image for that scale.
+*)
+
+module Prepared : sig
+  type t
+
+  (** [create r img ~scale] flattens the shapes of [img] at [scale] and
+      sorts their edges. [r] is only used for scratch space during the call.
+      The result keeps [img] alive; the memory it uses is accounted for by the
+      GC. It holds the paints of the shapes as they are during the call: once
+      a shape of [img] is changed (see {!Shape.set_fill_color}), it can no
+      longer be rendered, and a new one must be created. *)
+  val create : Rasterizer.t -> Image_data.t -> scale:float -> t
+
+  val image : t -> Image_data.t
+  val scale : t -> float
+end
+
+(** [rasterize_prepared r p ~tx ~ty ~dst ~w ~h ?stride ()] renders the
+    prepared image [p] like {!rasterize} would render [Prepared.image p] at
+    [Prepared.scale p]. Only the scanline stage is run: the shapes are not
+    flattened again.
+    @raise Invalid_argument if a shape of [Prepared.image p] was changed
+    after [p] was created. *)
+val rasterize_prepared :
+  Rasterizer.t -> Prepared.t ->
+  tx:float -> ty:float ->
+  dst:data8 -> w:int -> h:int -> ?stride:int ->
+  unit ->
+  unit
+
+(** [rasterize_prepared_region r p ~region ~tx ~ty ~dst ~w ~h ?stride ()] is
+    {!rasterize_region} for a prepared image.
+    @raise Invalid_argument if a shape of [Prepared.image p] was changed
+    after [p] was created. *)
+val rasterize_prepared_region :
+  Rasterizer.t -> Prepared.t ->
+  region:box ->
+  tx:float -> ty:float ->
+  dst:data8 -> w:int -> h:int -> ?stride:int ->
+  unit ->
+  unit
+
+(** {1 Hit-testing}
+
+    A spatial index over the shapes of a raw image answers "which shapes are
+    under this point" and "which shapes overlap this rectangle" without going
+    through all of them. Coordinates are those of the image, before the
+    scaling and translation done when rasterizing; shapes are designated by
+    their position in the image, as visited by {!Shape.iter}.
+
+    Only the shapes with paths are indexed: text shapes, whose extent depends
+    on the font, are not. Queries only return visible shapes, and look at
+    their current paints, so an index stays valid when shapes are changed
+    with the [Shape.set_*] functions. *)
+
+module Index : sig
+  type t
+
+  (** [create img] builds the index of the shapes of [img] (a bounding volume
+      hierarchy over their bounds). The result keeps [img] alive; the memory
+      it uses is accounted for by the GC. *)
+  val create : Image_data.t -> t
+
+  val image : t -> Image_data.t
+
+  (** Number of shapes of the image, indexed or not. *)
+  val length : t -> int
+
+  (** [shape i n] is the [n]-th shape of [image i].
+      @raise Invalid_argument if [n] is out of bounds. *)
+  val shape : t -> int -> Shape.t
+
+  (** [query i box] are the positions, in increasing order, of the visible
+      shapes whose bounds, extended by their stroke, overlap [box]. *)
+  val query : t -> box -> int array
+
+  (** [hits ?tolerance i ~x ~y] are the positions of the shapes painted at
+      [(x, y)], topmost first: visible shapes with a fill paint such that
+      {!Shape.fill_contains} holds, or with a stroke paint such that
+      {!Shape.stroke_contains} holds. *)
+  val hits : ?tolerance:float -> t -> x:float -> y:float -> int array
+
+  (** [pick ?tolerance i ~x ~y] is the position of the topmost shape painted
+      at [(x, y)], if any. It is the first element of [hits]. *)
+  val pick : ?tolerance:float -> t -> x:float -> y:float -> int option
+end
+
+(** {1 Retained rendering}
+
+    A render target keeps the rendering of an image and, when shapes of the
+    image are changed with the [Shape.set_*] functions, only draws again the
+    pixels that the changed shapes cover. The cost of an update depends on
+    the area of the changes and on the shapes overlapping it, rather than on
+    the whole image.
+*)
+
+module Target : sig
+  type t
+
+  (** [create r img ~tx ~ty ~scale ~w ~h] is a target holding the rendering
+      of [img] by {!rasterize} with these parameters, into a buffer of its
+      own. Nothing is drawn until the first {!update}. The rasterizer [r] is
+      used by every update, and gives the format of the pixels.
+
+      @raise Invalid_argument if [r] composites over its destination. *)
+  val create :
+    Rasterizer.t -> Image_data.t ->
+    tx:float -> ty:float -> scale:float -> w:int -> h:int ->
+    t
+
+  val image : t -> Image_data.t
+
+  (** The pixels of the target ([w * Rasterizer.bytes_per_pixel r] bytes per
+      row). They are up to date after {!update}. *)
+  val pixels : t -> data8
+
+  (** [update t] draws again the part of the image that changed since the
+      last update, and returns the rectangle of pixels [(x0, y0, x1, y1)]
+      (with [x1] and [y1] excluded) that was redrawn, if any. The first update
+      draws the whole image. The last 256 changes of an image are recorded;
+      if more happened since the previous update, the whole image is drawn
+      again. *)
+  val update : t -> (int * int * int * int) option
+
+  (** [invalidate t] makes the next {!update} draw the whole image. *)
+  val invalidate : t -> unit
+end
@@ -1,12 +1,22 @@
 #include <stdio.h>
 #include <assert.h>
 #include <string.h>
+#include <stdatomic.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 #define CAML_NAME_SPACE
 #include <caml/mlvalues.h>
 #include <caml/alloc.h>
 #include <caml/memory.h>
 #include <caml/bigarray.h>
 #include <caml/fail.h>
+#include <caml/signals.h>
+#include <caml/callback.h>
+#include <caml/custom.h>
 #define NANOSVG_ALL_COLOR_KEYWORDS	// Include full list of color keywords.
 #define NANOSVG_IMPLEMENTATION
 #define NANOSVGRAST_IMPLEMENTATION
@@ -309,9 +319,173 @@ value caml_nsvg_alloc_image(NSVGimage* image) {
   CAMLreturn(ret);
 }
 
-value caml_nsvg_delete_image_c_data(value c_data) {
-  nsvgDelete((NSVGimage*) (c_data & ~1));
-  return Val_unit;
+// Raw images are custom blocks holding a pointer to the NSVGimage. The GC is
+// told the amount of C memory held by the image.
+//
+// Parsed images live in the few large blocks allocated by the parser (see
+// nsvgImageMemory), freed by nsvgDelete. They can also be compacted into a
+// single block of memory (see caml_nsvg_compact). Images loaded from their
+// serialized form (see "Serialization" below) live inside a block of memory
+// that may hold several of them. Such a block is shared by its images through a reference-counted
+// owner, and freed (or unmapped) with the last of them.
+
+// Log of the changes made to the shapes of an image by the Shape.set_*
+// functions, read by render targets to redraw only what changed. Change
+// number g (counting from 1) is kept at g % CAML_NSVG_DIRTY_LOG, so only the
+// last CAML_NSVG_DIRTY_LOG changes are known.
+//
+// The log belongs to the NSVGimage, not to the custom block: the images of a
+// block may be reached through several custom blocks (see Bundle.get), so the
+// logs of the changed images of a block are kept in a list in its owner. An
+// image freed with nsvgDelete has a single custom block, which holds its log.
+
+#define CAML_NSVG_DIRTY_LOG 256
+
+typedef struct caml_nsvg_dirty {
+  struct caml_nsvg_dirty* next; // in the list of the owner
+  NSVGimage* image;
+  intnat generation;      // number of changes so far
+  float bounds[CAML_NSVG_DIRTY_LOG][4];
+} caml_nsvg_dirty;
+
+typedef struct caml_nsvg_owner {
+  atomic_int refs;
+  char* data;
+  size_t size;
+  int mapped;
+  _Atomic(caml_nsvg_dirty*) dirty; // logs of the changed images of the block
+} caml_nsvg_owner;
+
+typedef struct caml_nsvg_image {
+  NSVGimage* image;
+  caml_nsvg_owner* owner; // NULL if the image is freed with nsvgDelete
+  caml_nsvg_dirty* dirty; // NULL until the log of the image is looked up
+#ifdef NSVG_PROFILE
+  NSVGparseStats stats;   // all zero if the image was not parsed
+#endif
+} caml_nsvg_image;
+
+#define Image_val(v) (((caml_nsvg_image*) Data_custom_val(v))->image)
+#define Image_owner_val(v) (((caml_nsvg_image*) Data_custom_val(v))->owner)
+#define Image_dirty_val(v) (((caml_nsvg_image*) Data_custom_val(v))->dirty)
+#define Image_stats_val(v) (((caml_nsvg_image*) Data_custom_val(v))->stats)
+
+static caml_nsvg_owner* caml_nsvg_new_owner(char* data, size_t size, int mapped) {
+  caml_nsvg_owner* owner = malloc(sizeof(caml_nsvg_owner));
+  if (owner == NULL) return NULL;
+  atomic_init(&owner->refs, 1);
+  owner->data = data;
+  owner->size = size;
+  owner->mapped = mapped;
+  atomic_init(&owner->dirty, NULL);
+  return owner;
+}
+
+static void caml_nsvg_release_owner(caml_nsvg_owner* owner) {
+  caml_nsvg_dirty *dirty, *next;
+  if (atomic_fetch_sub(&owner->refs, 1) != 1) return;
+  for (dirty = atomic_load(&owner->dirty); dirty != NULL; dirty = next) {
+    next = dirty->next;
+    free(dirty);
+  }
+#ifndef _WIN32
+  if (owner->mapped)
+    munmap(owner->data, owner->size);
+  else
+#endif
+    free(owner->data);
+  free(owner);
+}
+
+static void caml_nsvg_finalize_image(value v) {
+  if (Image_owner_val(v) != NULL) {
+    caml_nsvg_release_owner(Image_owner_val(v));
+  } else {
+    free(Image_dirty_val(v));
+    nsvgDelete(Image_val(v));
+  }
+}
+
+static struct custom_operations caml_nsvg_image_ops = {
+  "nanosvg.image",
+  caml_nsvg_finalize_image,
+  custom_compare_default,
+  custom_hash_default,
+  custom_serialize_default,
+  custom_deserialize_default,
+  custom_compare_ext_default,
+  custom_fixed_length_default
+};
+
+static value caml_nsvg_alloc_image_data(NSVGimage* image) {
+  value ret = caml_alloc_custom_mem(&caml_nsvg_image_ops, sizeof(caml_nsvg_image),
+                                    nsvgImageMemory(image));
+  Image_val(ret) = image;
+  Image_owner_val(ret) = NULL;
+  Image_dirty_val(ret) = NULL;
+#ifdef NSVG_PROFILE
+  memset(&Image_stats_val(ret), 0, sizeof(NSVGparseStats));
+#endif
+  return ret;
+}
+
+// [image] lives in the block of [owner], and takes a reference to it. [mem]
+// is the amount of memory charged to the GC for this image.
+static value caml_nsvg_alloc_owned_image(NSVGimage* image, caml_nsvg_owner* owner, size_t mem) {
+  value ret = caml_alloc_custom_mem(&caml_nsvg_image_ops, sizeof(caml_nsvg_image), mem);
+  atomic_fetch_add(&owner->refs, 1);
+  Image_val(ret) = image;
+  Image_owner_val(ret) = owner;
+  Image_dirty_val(ret) = NULL;
+#ifdef NSVG_PROFILE
+  memset(&Image_stats_val(ret), 0, sizeof(NSVGparseStats));
+#endif
+  return ret;
+}
+
+// Copies a parsed image into a single block of memory, in the order in which
+// the rasterizer reads it, and frees the original. The block is freed at once
+// and its exact size is charged to the GC. Both copies exist until the copy is
+// written, so the memory used briefly doubles: this is only done on request,
+// since the parser already allocates few blocks. If [compact] is 0 or the copy
+// cannot be allocated, the original image is returned with a NULL [*owner].
+// To be called without the runtime lock.
+static NSVGimage* caml_nsvg_compact(NSVGimage* image, int compact, caml_nsvg_owner** owner) {
+  size_t size;
+  char* data;
+  *owner = NULL;
+  if (image == NULL || !compact) return image;
+  size = nsvgFlatSize(image);
+  data = malloc(size);
+  if (data == NULL) return image;
+  *owner = caml_nsvg_new_owner(data, size, 0);
+  if (*owner == NULL) {
+    free(data);
+    return image;
+  }
+  nsvgWriteFlat(image, data, (uintptr_t)data);
+  nsvgDelete(image);
+  return (NSVGimage*)data;
+}
+
+static value caml_nsvg_image_option(NSVGimage* image, caml_nsvg_owner* owner,
+                                    NSVGparseStats* stats) {
+  CAMLparam0();
+  CAMLlocal1(ret);
+  if (image == NULL)
+    CAMLreturn(Val_none);
+  if (owner == NULL) {
+    ret = caml_nsvg_alloc_image_data(image);
+  } else {
+    ret = caml_nsvg_alloc_owned_image(image, owner, owner->size);
+    caml_nsvg_release_owner(owner); // now only referenced by the image
+  }
+#ifdef NSVG_PROFILE
+  Image_stats_val(ret) = *stats;
+#else
+  (void)stats;
+#endif
+  CAMLreturn(caml_alloc_some(ret));
 }
 
 // NSVGImage width/height accessors
@@ -319,7 +493,7 @@ value caml_nsvg_delete_image_c_data(value c_data) {
 value caml_nsvg_image_width(value image) {
   CAMLparam1(image);
   CAMLlocal1(ret);
-  NSVGimage* image_p = (NSVGimage*) (image & ~1);
+  NSVGimage* image_p = Image_val(image);
   ret = caml_copy_double((double)image_p->width);
   CAMLreturn(ret);
 }
@@ -327,7 +501,7 @@ value caml_nsvg_image_width(value image) {
 value caml_nsvg_image_height(value image) {
   CAMLparam1(image);
   CAMLlocal1(ret);
-  NSVGimage* image_p = (NSVGimage*) (image & ~1);
+  NSVGimage* image_p = Image_val(image);
   ret = caml_copy_double((double)image_p->height);
   CAMLreturn(ret);
 }
@@ -335,79 +509,1074 @@ value caml_nsvg_image_height(value image) {
 value caml_nsvg_image_viewXform(value image) {
   CAMLparam1(image);
   CAMLlocal1(ret);
-  NSVGimage* image_p = (NSVGimage*) (image & ~1);
+  NSVGimage* image_p = Image_val(image);
   ret = caml_alloc_float_array(6);
   for (int i = 0; i < 6; i++)
     Store_double_array_field(ret, i, (double)image_p->viewXform[i]);
   CAMLreturn(ret);
 }
 
+// Profiling counters, only collected if the library is compiled with
+// NSVG_PROFILE defined
+
+value caml_nsvg_image_parse_stats(value image) {
+  CAMLparam1(image);
+#ifdef NSVG_PROFILE
+  CAMLlocal1(ret);
+  NSVGparseStats* stats = &Image_stats_val(image);
+  ret = caml_alloc_tuple(3);
+  Store_field(ret, 0, Val_int(stats->elements));
+  Store_field(ret, 1, Val_int(stats->pathCommands));
+  Store_field(ret, 2, Val_int(stats->gradients));
+  CAMLreturn(caml_alloc_some(ret));
+#else
+  CAMLreturn(Val_none);
+#endif
+}
+
 // lift
 
-value caml_nsvg_lift(value c_data) {
-  CAMLparam1(c_data);
+value caml_nsvg_lift(value img) {
+  CAMLparam1(img);
   CAMLlocal1(ret);
-  NSVGimage* image = (NSVGimage*) (c_data & ~1);
+  NSVGimage* image = Image_val(img);
   ret = caml_nsvg_alloc_image(image);
   CAMLreturn(ret);
 }
 
-// parsing
+// Lazy inspection
+//
+// Shapes and paths are handed to OCaml as records { img; ptr } (see
+// nanosvg.ml), where [ptr] points inside the image [img]. Keeping [img] in the
+// record ensures that the image outlives the shape or path.
+
+#define Shape_ptr_val(v) ((NSVGshape*) (Field(v, 1) & ~1))
+#define Path_ptr_val(v) ((NSVGpath*) (Field(v, 1) & ~1))
 
-value caml_nsvg_parse_from_file(value filename, value units, value dpi) {
-  CAMLparam3(filename, units, dpi);
+static value caml_nsvg_alloc_cursor(value img, void* ptr) {
+  CAMLparam1(img);
   CAMLlocal1(ret);
-  NSVGimage* image = nsvgParseFromFile(String_val(filename), String_val(units), (float)Double_val(dpi));
-  if (image) {
-    assert (((uintptr_t) image & 1) == 0);
-    ret = caml_alloc_some((value) image | 1);
+  ret = caml_alloc_small(2, 0);
+  Field(ret, 0) = img;
+  Field(ret, 1) = (value) ptr | 1;
+  CAMLreturn(ret);
+}
+
+value caml_nsvg_shape_iter(value f, value img) {
+  CAMLparam2(f, img);
+  CAMLlocal1(cur);
+  NSVGimage* image = Image_val(img);
+  for (NSVGshape* shape = image->shapes; shape != NULL; shape = shape->next) {
+    cur = caml_nsvg_alloc_cursor(img, shape);
+    caml_callback(f, cur);
+  }
+  CAMLreturn(Val_unit);
+}
+
+value caml_nsvg_shape_id(value shape) {
+  CAMLparam1(shape);
+  NSVGshape* shape_p = Shape_ptr_val(shape);
+  CAMLreturn(caml_alloc_initialized_string(strnlen(shape_p->id, 64), shape_p->id));
+}
+
+value caml_nsvg_shape_fill(value shape) {
+  CAMLparam1(shape);
+  CAMLreturn(caml_nsvg_alloc_paint(&Shape_ptr_val(shape)->fill));
+}
+
+value caml_nsvg_shape_stroke(value shape) {
+  CAMLparam1(shape);
+  CAMLreturn(caml_nsvg_alloc_paint(&Shape_ptr_val(shape)->stroke));
+}
+
+value caml_nsvg_shape_opacity(value shape) {
+  CAMLparam1(shape);
+  CAMLreturn(caml_copy_double(Shape_ptr_val(shape)->opacity));
+}
+
+value caml_nsvg_shape_stroke_width(value shape) {
+  CAMLparam1(shape);
+  CAMLreturn(caml_copy_double(Shape_ptr_val(shape)->strokeWidth));
+}
+
+value caml_nsvg_shape_fill_rule(value shape) {
+  return Val_int(Shape_ptr_val(shape)->fillRule);
+}
+
+value caml_nsvg_shape_visible(value shape) {
+  return Val_bool(Shape_ptr_val(shape)->flags & NSVG_FLAGS_VISIBLE);
+}
+
+value caml_nsvg_shape_bounds(value shape) {
+  CAMLparam1(shape);
+  CAMLreturn(caml_nsvg_alloc_bounds(Shape_ptr_val(shape)->bounds));
+}
+
+value caml_nsvg_shape_text(value shape) {
+  CAMLparam1(shape);
+  CAMLlocal2(ret, tmp);
+  NSVGshape* shape_p = Shape_ptr_val(shape);
+  if (shape_p->text) {
+    tmp = caml_nsvg_alloc_text(shape_p->text);
+    ret = caml_alloc_some(tmp);
   } else {
     ret = Val_none;
   }
   CAMLreturn(ret);
 }
 
-value caml_nsvg_parse(value data, value units, value dpi) {
-  CAMLparam3(data, units, dpi);
-  CAMLlocal1(ret);
-  char* data_s = strdup(String_val(data));
-  NSVGimage* image = nsvgParse(data_s, String_val(units), (float)Double_val(dpi));
-  if (image) {
-    assert (((uintptr_t) image & 1) == 0);
-    ret = caml_alloc_some((value) image | 1);
+value caml_nsvg_shape_iter_paths(value f, value shape) {
+  CAMLparam2(f, shape);
+  CAMLlocal2(img, cur);
+  img = Field(shape, 0);
+  for (NSVGpath* path = Shape_ptr_val(shape)->paths; path != NULL; path = path->next) {
+    cur = caml_nsvg_alloc_cursor(img, path);
+    caml_callback(f, cur);
+  }
+  CAMLreturn(Val_unit);
+}
+
+// Changes to shapes. They are recorded in the dirty log of the image of the
+// shape, with the area of the shape on which they may change pixels.
+
+// The log of [img], created if [create] is set, or NULL. Logs are only ever
+// pushed at the head of the list of an owner, so the one found for an image
+// stays valid, and is kept in the custom block for the next lookups.
+static caml_nsvg_dirty* caml_nsvg_image_dirty(value img, int create) {
+  caml_nsvg_owner* owner = Image_owner_val(img);
+  NSVGimage* image = Image_val(img);
+  caml_nsvg_dirty *dirty = Image_dirty_val(img), *head, *seen = NULL, *found;
+  if (dirty != NULL) return dirty;
+  if (owner != NULL) {
+    head = atomic_load(&owner->dirty);
+    for (;;) {
+      // only the logs pushed since the last attempt are new
+      for (found = head; found != seen; found = found->next)
+        if (found->image == image) {
+          free(dirty);
+          return Image_dirty_val(img) = found;
+        }
+      if (!create) return NULL;
+      if (dirty == NULL) {
+        dirty = calloc(1, sizeof(caml_nsvg_dirty));
+        if (dirty == NULL) caml_raise_out_of_memory();
+        dirty->image = image;
+      }
+      dirty->next = seen = head;
+      if (atomic_compare_exchange_weak(&owner->dirty, &head, dirty))
+        break;
+    }
   } else {
-    ret = Val_none;
+    if (!create) return NULL;
+    dirty = calloc(1, sizeof(caml_nsvg_dirty));
+    if (dirty == NULL) caml_raise_out_of_memory();
+    dirty->image = image;
+  }
+  return Image_dirty_val(img) = dirty;
+}
+
+static void caml_nsvg_shape_changed(value shape) {
+  caml_nsvg_dirty* dirty = caml_nsvg_image_dirty(Field(shape, 0), 1);
+  dirty->generation++;
+  nsvgShapePaintBounds(Shape_ptr_val(shape), dirty->bounds[dirty->generation % CAML_NSVG_DIRTY_LOG]);
+}
+
+static void caml_nsvg_set_paint_color(value shape, NSVGpaint* paint, value color) {
+  unsigned int color_u = (unsigned int)Int32_val(color);
+  if (paint->type == NSVG_PAINT_COLOR && paint->color == color_u)
+    return;
+  // the gradient is left in the memory of the image, which is freed at once:
+  // a rasterizer running on another thread may still be reading it
+  paint->type = NSVG_PAINT_COLOR;
+  paint->color = color_u;
+  caml_nsvg_shape_changed(shape);
+}
+
+value caml_nsvg_shape_set_fill_color(value shape, value color) {
+  caml_nsvg_set_paint_color(shape, &Shape_ptr_val(shape)->fill, color);
+  return Val_unit;
+}
+
+value caml_nsvg_shape_set_stroke_color(value shape, value color) {
+  caml_nsvg_set_paint_color(shape, &Shape_ptr_val(shape)->stroke, color);
+  return Val_unit;
+}
+
+value caml_nsvg_shape_set_opacity(value shape, value opacity) {
+  NSVGshape* shape_p = Shape_ptr_val(shape);
+  float opacity_f = (float)Double_val(opacity);
+  if (shape_p->opacity != opacity_f) {
+    shape_p->opacity = opacity_f;
+    caml_nsvg_shape_changed(shape);
   }
+  return Val_unit;
+}
+
+value caml_nsvg_shape_set_visible(value shape, value visible) {
+  NSVGshape* shape_p = Shape_ptr_val(shape);
+  unsigned char flags = Bool_val(visible) ? (shape_p->flags | NSVG_FLAGS_VISIBLE)
+                                          : (shape_p->flags & ~NSVG_FLAGS_VISIBLE);
+  if (shape_p->flags != flags) {
+    shape_p->flags = flags;
+    caml_nsvg_shape_changed(shape);
+  }
+  return Val_unit;
+}
+
+value caml_nsvg_image_generation(value img) {
+  caml_nsvg_dirty* dirty = caml_nsvg_image_dirty(img, 0);
+  return Val_long(dirty == NULL ? 0 : dirty->generation);
+}
+
+// Union of the areas of the changes made after generation [since], or None
+// if they are not all in the log anymore.
+value caml_nsvg_image_changes_since(value img, value since) {
+  CAMLparam2(img, since);
+  CAMLlocal2(box, ret);
+  caml_nsvg_dirty* dirty = caml_nsvg_image_dirty(img, 0);
+  intnat since_n = Long_val(since), gen = dirty == NULL ? 0 : dirty->generation;
+  float bounds[4] = { 1e30f, 1e30f, -1e30f, -1e30f };
+  if (since_n < 0 || since_n > gen || gen - since_n > CAML_NSVG_DIRTY_LOG)
+    CAMLreturn(Val_none);
+  for (intnat g = since_n + 1; g <= gen; g++) {
+    float* b = dirty->bounds[g % CAML_NSVG_DIRTY_LOG];
+    if (b[0] < bounds[0]) bounds[0] = b[0];
+    if (b[1] < bounds[1]) bounds[1] = b[1];
+    if (b[2] > bounds[2]) bounds[2] = b[2];
+    if (b[3] > bounds[3]) bounds[3] = b[3];
+  }
+  box = caml_nsvg_alloc_bounds(bounds);
+  ret = caml_alloc_some(box);
   CAMLreturn(ret);
 }
 
+// The points are copied into a bigarray that owns its data: a view on the
+// image, or any sub-array of it, could outlive the image.
+value caml_nsvg_path_points(value path) {
+  CAMLparam1(path);
+  CAMLlocal1(ret);
+  intnat n = (intnat) Path_ptr_val(path)->npts * 2;
+  ret = caml_ba_alloc_dims(CAML_BA_FLOAT32 | CAML_BA_C_LAYOUT, 1, NULL, n);
+  // [path] is read again after the allocation, which may move it
+  memcpy(Caml_ba_data_val(ret), Path_ptr_val(path)->pts, n * sizeof(float));
+  CAMLreturn(ret);
+}
+
+// Single points are read in place, without allocating: [path] keeps the image
+// alive, and nothing is retained once the value is returned.
+value caml_nsvg_path_npoints(value path) {
+  return Val_int(Path_ptr_val(path)->npts);
+}
+
+double caml_nsvg_path_x(value path, intnat i) {
+  return Path_ptr_val(path)->pts[2*i];
+}
+
+value caml_nsvg_path_x_bytecode(value path, value i) {
+  return caml_copy_double(caml_nsvg_path_x(path, Long_val(i)));
+}
+
+double caml_nsvg_path_y(value path, intnat i) {
+  return Path_ptr_val(path)->pts[2*i+1];
+}
+
+value caml_nsvg_path_y_bytecode(value path, value i) {
+  return caml_copy_double(caml_nsvg_path_y(path, Long_val(i)));
+}
+
+value caml_nsvg_path_closed(value path) {
+  return Val_bool(Path_ptr_val(path)->closed);
+}
+
+value caml_nsvg_path_bounds(value path) {
+  CAMLparam1(path);
+  CAMLreturn(caml_nsvg_alloc_bounds(Path_ptr_val(path)->bounds));
+}
+
+// parsing
+
+// The runtime lock is released while parsing: the input is first copied
+// outside of the OCaml heap so that it cannot be moved or collected while the
+// parser runs. Since the parser writes into its input, the copy goes to a
+// scratch buffer which is kept around for the next call. Parses running
+// concurrently allocate their own buffer; only one is kept. Buffers larger
+// than CAML_NSVG_SCRATCH_MAX are freed after use, so that one large document
+// does not pin its size in memory for the lifetime of the program.
+
+#define CAML_NSVG_SCRATCH_MAX (1 << 20)
+
+typedef struct caml_nsvg_scratch {
+  size_t size;
+  char data[];
+} caml_nsvg_scratch;
+
+static _Atomic(caml_nsvg_scratch*) caml_nsvg_scratch_cache = NULL;
+
+static caml_nsvg_scratch* caml_nsvg_take_scratch(size_t size) {
+  caml_nsvg_scratch* buf = atomic_exchange(&caml_nsvg_scratch_cache, NULL);
+  if (buf == NULL || buf->size < size) {
+    free(buf);
+    buf = malloc(sizeof(caml_nsvg_scratch) + size);
+    if (buf == NULL) return NULL;
+    buf->size = size;
+  }
+  return buf;
+}
+
+static void caml_nsvg_release_scratch(caml_nsvg_scratch* buf) {
+  if (buf->size > CAML_NSVG_SCRATCH_MAX) {
+    free(buf);
+    return;
+  }
+  // keep the largest buffer
+  caml_nsvg_scratch* old = atomic_exchange(&caml_nsvg_scratch_cache, buf);
+  if (old != NULL && old->size > buf->size)
+    old = atomic_exchange(&caml_nsvg_scratch_cache, old);
+  free(old);
+}
+
+// Parses a copy of [data] (which must be kept alive by the caller). To be
+// called without the runtime lock.
+static NSVGimage* caml_nsvg_parse_copy(const char* data, size_t len, const char* units, float dpi,
+                                      NSVGparseStats* stats) {
+  NSVGimage* image;
+  caml_nsvg_scratch* buf = caml_nsvg_take_scratch(len);
+  if (buf == NULL) return NULL;
+  memcpy(buf->data, data, len);
+  image = nsvgParseBufferStats(buf->data, len, units, dpi, stats);
+  caml_nsvg_release_scratch(buf);
+  return image;
+}
+
+static NSVGimage* caml_nsvg_parse_file(const char* filename, const char* units, float dpi,
+                                      NSVGparseStats* stats) {
+  FILE* fp = NULL;
+  long size;
+  caml_nsvg_scratch* buf = NULL;
+  NSVGimage* image = NULL;
+
+  fp = fopen(filename, "rb");
+  if (!fp) goto error;
+  if (fseek(fp, 0, SEEK_END) != 0) goto error;
+  size = ftell(fp);
+  if (size < 0 || fseek(fp, 0, SEEK_SET) != 0) goto error;
+  buf = caml_nsvg_take_scratch(size);
+  if (buf == NULL) goto error;
+  if (fread(buf->data, 1, size, fp) != (size_t)size) goto error;
+  fclose(fp);
+  image = nsvgParseBufferStats(buf->data, size, units, dpi, stats);
+  caml_nsvg_release_scratch(buf);
+  return image;
+
+error:
+  if (fp) fclose(fp);
+  if (buf) caml_nsvg_release_scratch(buf);
+  return NULL;
+}
+
+#ifndef _WIN32
+// The file is mapped privately: the parser writes into the mapping, which
+// only copies the pages that are written to and leaves the file untouched.
+static NSVGimage* caml_nsvg_parse_file_mmap(const char* filename, const char* units, float dpi,
+                                           NSVGparseStats* stats) {
+  struct stat st;
+  char* data;
+  NSVGimage* image;
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) return NULL;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return NULL;
+  }
+  if (st.st_size == 0) {
+    close(fd);
+    return nsvgParseBufferStats("", 0, units, dpi, stats);
+  }
+  data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) return NULL;
+  image = nsvgParseBufferStats(data, st.st_size, units, dpi, stats);
+  munmap(data, st.st_size);
+  return image;
+}
+#endif
+
+value caml_nsvg_parse_from_file(value filename, value units, value dpi, value use_mmap,
+                                value compact) {
+  CAMLparam5(filename, units, dpi, use_mmap, compact);
+  char* filename_s = caml_stat_strdup(String_val(filename));
+  char* units_s = caml_stat_strdup(String_val(units));
+  float dpi_f = (float)Double_val(dpi);
+  NSVGimage* image;
+  caml_nsvg_owner* owner;
+  NSVGparseStats stats;
+  caml_enter_blocking_section();
+#ifndef _WIN32
+  if (Bool_val(use_mmap))
+    image = caml_nsvg_parse_file_mmap(filename_s, units_s, dpi_f, &stats);
+  else
+#endif
+    image = caml_nsvg_parse_file(filename_s, units_s, dpi_f, &stats);
+  image = caml_nsvg_compact(image, Bool_val(compact), &owner);
+  caml_leave_blocking_section();
+  caml_stat_free(filename_s);
+  caml_stat_free(units_s);
+  CAMLreturn(caml_nsvg_image_option(image, owner, &stats));
+}
+
+value caml_nsvg_parse(value data, value units, value dpi, value compact) {
+  CAMLparam4(data, units, dpi, compact);
+  size_t len = caml_string_length(data);
+  caml_nsvg_scratch* buf = caml_nsvg_take_scratch(len);
+  char* units_s = caml_stat_strdup(String_val(units));
+  float dpi_f = (float)Double_val(dpi);
+  NSVGimage* image = NULL;
+  caml_nsvg_owner* owner = NULL;
+  NSVGparseStats stats;
+  // the OCaml string may move once the lock is released: copy it first
+  if (buf != NULL) {
+    memcpy(buf->data, String_val(data), len);
+    caml_enter_blocking_section();
+    image = nsvgParseBufferStats(buf->data, len, units_s, dpi_f, &stats);
+    caml_nsvg_release_scratch(buf);
+    image = caml_nsvg_compact(image, Bool_val(compact), &owner);
+    caml_leave_blocking_section();
+  }
+  caml_stat_free(units_s);
+  CAMLreturn(caml_nsvg_image_option(image, owner, &stats));
+}
+
+// The bigarray data lives outside of the OCaml heap, and is kept alive by
+// [data] during the call.
+value caml_nsvg_parse_bigstring(value data, value units, value dpi, value in_place,
+                                value compact) {
+  CAMLparam5(data, units, dpi, in_place, compact);
+  char* data_p = (char*)Caml_ba_data_val(data);
+  size_t len = caml_ba_byte_size(Caml_ba_array_val(data));
+  char* units_s = caml_stat_strdup(String_val(units));
+  float dpi_f = (float)Double_val(dpi);
+  NSVGimage* image;
+  caml_nsvg_owner* owner;
+  NSVGparseStats stats;
+  caml_enter_blocking_section();
+  if (Bool_val(in_place))
+    image = nsvgParseBufferStats(data_p, len, units_s, dpi_f, &stats);
+  else
+    image = caml_nsvg_parse_copy(data_p, len, units_s, dpi_f, &stats);
+  image = caml_nsvg_compact(image, Bool_val(compact), &owner);
+  caml_leave_blocking_section();
+  caml_stat_free(units_s);
+  CAMLreturn(caml_nsvg_image_option(image, owner, &stats));
+}
+
+// Serialization
+//
+// A serialized image is a header followed by the relocatable flat copy of the
+// image written by nsvgWriteFlat. The flat copy uses the in-memory layout of
+// the nanosvg structures: it can only be loaded by the same version of the
+// library, on a platform with the same pointer size and byte order, which the
+// header records. Loading an image costs a checksum and a pointer fixup.
+
+#define CAML_NSVG_FLAT_MAGIC "NSVGFLAT"
+#define CAML_NSVG_FLAT_VERSION 2
+
+typedef struct caml_nsvg_flat_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t layout;   // see caml_nsvg_flat_layout
+  uint64_t size;     // size of the flat image following the header
+  uint64_t checksum; // of the flat image
+} caml_nsvg_flat_header;
+
+static uint64_t caml_nsvg_checksum(const char* data, size_t size) {
+  uint64_t h = 14695981039346656037ULL;
+  size_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    uint64_t w;
+    memcpy(&w, data + i, 8);
+    h = (h ^ w) * 1099511628211ULL;
+    h ^= h >> 29;
+  }
+  for (; i < size; i++)
+    h = (h ^ (unsigned char)data[i]) * 1099511628211ULL;
+  return h;
+}
+
+// Fingerprint of the pointer size, byte order, and sizes of the structures
+// stored in a flat image.
+static uint32_t caml_nsvg_flat_layout(void) {
+  const uint16_t one = 1;
+  const uint32_t sizes[] = {
+    sizeof(void*), *(const uint8_t*)&one,
+    sizeof(NSVGimage), sizeof(NSVGshape), sizeof(NSVGpath),
+    sizeof(NSVGpaint), sizeof(NSVGgradient), sizeof(NSVGgradientStop),
+    sizeof(NSVGtext)
+  };
+  return (uint32_t)caml_nsvg_checksum((const char*)sizes, sizeof(sizes));
+}
+
+// Checks the serialized image of [len] bytes at [data], which must be aligned
+// for pointers, and relocates it in place. Returns NULL if it is not a valid
+// serialized image for this library and platform.
+static NSVGimage* caml_nsvg_load_flat(char* data, size_t len) {
+  caml_nsvg_flat_header hdr;
+  if (len < sizeof(hdr)) return NULL;
+  memcpy(&hdr, data, sizeof(hdr));
+  if (memcmp(hdr.magic, CAML_NSVG_FLAT_MAGIC, 8) != 0
+      || hdr.version != CAML_NSVG_FLAT_VERSION
+      || hdr.layout != caml_nsvg_flat_layout()
+      || hdr.size != len - sizeof(hdr))
+    return NULL;
+  if (caml_nsvg_checksum(data + sizeof(hdr), hdr.size) != hdr.checksum)
+    return NULL;
+  return nsvgRelocateFlat(data + sizeof(hdr), hdr.size);
+}
+
+value caml_nsvg_image_to_bytes(value img) {
+  CAMLparam1(img);
+  CAMLlocal1(ret);
+  NSVGimage* image = Image_val(img);
+  size_t size = nsvgFlatSize(image);
+  caml_nsvg_flat_header hdr;
+  char* flat;
+  // OCaml blocks are aligned for pointers, and so is the flat image after the
+  // header
+  ret = caml_alloc_string(sizeof(hdr) + size);
+  flat = (char*)Bytes_val(ret) + sizeof(hdr);
+  nsvgWriteFlat(image, flat, 0);
+  memcpy(hdr.magic, CAML_NSVG_FLAT_MAGIC, 8);
+  hdr.version = CAML_NSVG_FLAT_VERSION;
+  hdr.layout = caml_nsvg_flat_layout();
+  hdr.size = size;
+  hdr.checksum = caml_nsvg_checksum(flat, size);
+  memcpy(Bytes_val(ret), &hdr, sizeof(hdr));
+  CAMLreturn(ret);
+}
+
+value caml_nsvg_image_of_bytes(value b) {
+  CAMLparam1(b);
+  CAMLlocal1(ret);
+  size_t len = caml_string_length(b);
+  char* data = malloc(len > 0 ? len : 1);
+  caml_nsvg_owner* owner = NULL;
+  NSVGimage* image;
+  if (data == NULL) caml_raise_out_of_memory();
+  // the OCaml bytes may move once the lock is released: copy them first
+  memcpy(data, Bytes_val(b), len);
+  caml_enter_blocking_section();
+  image = caml_nsvg_load_flat(data, len);
+  caml_leave_blocking_section();
+  if (image != NULL) owner = caml_nsvg_new_owner(data, len, 0);
+  if (owner == NULL) {
+    free(data);
+    CAMLreturn(Val_none);
+  }
+  ret = caml_nsvg_alloc_owned_image(image, owner, len);
+  caml_nsvg_release_owner(owner); // now only referenced by the image
+  CAMLreturn(caml_alloc_some(ret));
+}
+
+// Bundles
+//
+// A bundle is a file holding many serialized images, each with a name. It is
+// written from OCaml (see Bundle in nanosvg.ml) and has the following layout,
+// with integers in the byte order of the platform:
+// - header: the magic "NSVGBNDL", a 32-bit version and a 32-bit count;
+// - [count] entries of four 64-bit integers: the offset and length of the
+//   name, then the offset and length of the serialized image;
+// - the names, then the serialized images, each at an offset aligned on 8
+//   bytes.
+// All the images are relocated when loading the bundle. They stay in the
+// bundle memory, which is freed once the bundle and all of its images are
+// collected.
+
+#define CAML_NSVG_BUNDLE_MAGIC "NSVGBNDL"
+#define CAML_NSVG_BUNDLE_VERSION 1
+
+typedef struct caml_nsvg_bundle_entry {
+  uint64_t name_off;
+  uint64_t name_len;
+  uint64_t off;
+  uint64_t len;
+} caml_nsvg_bundle_entry;
+
+typedef struct caml_nsvg_bundle {
+  caml_nsvg_owner* owner;
+  uint32_t count;
+  const caml_nsvg_bundle_entry* entries; // in the bundle memory
+  NSVGimage** images;
+} caml_nsvg_bundle;
+
+#define Bundle_val(v) (*((caml_nsvg_bundle**) Data_custom_val(v)))
+
+static void caml_nsvg_delete_bundle(caml_nsvg_bundle* bundle) {
+  caml_nsvg_release_owner(bundle->owner);
+  free(bundle->images);
+  free(bundle);
+}
+
+static void caml_nsvg_finalize_bundle(value v) {
+  caml_nsvg_delete_bundle(Bundle_val(v));
+}
+
+static struct custom_operations caml_nsvg_bundle_ops = {
+  "nanosvg.bundle",
+  caml_nsvg_finalize_bundle,
+  custom_compare_default,
+  custom_hash_default,
+  custom_serialize_default,
+  custom_deserialize_default,
+  custom_compare_ext_default,
+  custom_fixed_length_default
+};
+
+// Takes ownership of [data], which must be aligned for pointers.
+static caml_nsvg_bundle* caml_nsvg_load_bundle(char* data, size_t size, int mapped) {
+  caml_nsvg_bundle* bundle = NULL;
+  caml_nsvg_owner* owner = caml_nsvg_new_owner(data, size, mapped);
+  uint32_t version, count;
+  size_t table_end;
+  if (owner == NULL) goto error;
+  if (size < 16 || memcmp(data, CAML_NSVG_BUNDLE_MAGIC, 8) != 0) goto error;
+  memcpy(&version, data + 8, 4);
+  memcpy(&count, data + 12, 4);
+  if (version != CAML_NSVG_BUNDLE_VERSION
+      || count > (size - 16) / sizeof(caml_nsvg_bundle_entry))
+    goto error;
+  table_end = 16 + (size_t)count * sizeof(caml_nsvg_bundle_entry);
+
+  bundle = malloc(sizeof(caml_nsvg_bundle));
+  if (bundle == NULL) goto error;
+  bundle->owner = owner;
+  bundle->count = count;
+  bundle->entries = (const caml_nsvg_bundle_entry*)(data + 16);
+  bundle->images = malloc(sizeof(NSVGimage*) * (count > 0 ? count : 1));
+  if (bundle->images == NULL) goto error;
+  for (uint32_t i = 0; i < count; i++) {
+    caml_nsvg_bundle_entry e = bundle->entries[i];
+    if (e.name_off > size || e.name_len > size - e.name_off) goto error;
+    if (e.off < table_end || e.off > size || e.len > size - e.off || e.off % 8 != 0)
+      goto error;
+    bundle->images[i] = caml_nsvg_load_flat(data + e.off, e.len);
+    if (bundle->images[i] == NULL) goto error;
+  }
+  return bundle;
+
+error:
+  if (bundle != NULL) {
+    free(bundle->images);
+    free(bundle);
+  }
+  if (owner != NULL)
+    caml_nsvg_release_owner(owner);
+  else
+    free(data);
+  return NULL;
+}
+
+static caml_nsvg_bundle* caml_nsvg_read_bundle(const char* filename) {
+  FILE* fp = fopen(filename, "rb");
+  long size;
+  char* data = NULL;
+  if (!fp) return NULL;
+  if (fseek(fp, 0, SEEK_END) != 0) goto error;
+  size = ftell(fp);
+  if (size < 0 || fseek(fp, 0, SEEK_SET) != 0) goto error;
+  data = malloc(size > 0 ? size : 1);
+  if (data == NULL) goto error;
+  if (fread(data, 1, size, fp) != (size_t)size) goto error;
+  fclose(fp);
+  return caml_nsvg_load_bundle(data, size, 0);
+
+error:
+  fclose(fp);
+  free(data);
+  return NULL;
+}
+
+#ifndef _WIN32
+// The file is mapped privately: relocating the images only copies the pages
+// holding them, and leaves the file untouched.
+static caml_nsvg_bundle* caml_nsvg_map_bundle(const char* filename) {
+  struct stat st;
+  char* data;
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) return NULL;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    return NULL;
+  }
+  data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) return NULL;
+  return caml_nsvg_load_bundle(data, st.st_size, 1);
+}
+#endif
+
+value caml_nsvg_bundle_load(value filename, value use_mmap) {
+  CAMLparam2(filename, use_mmap);
+  CAMLlocal1(ret);
+  char* filename_s = caml_stat_strdup(String_val(filename));
+  caml_nsvg_bundle* bundle;
+  caml_enter_blocking_section();
+#ifndef _WIN32
+  if (Bool_val(use_mmap))
+    bundle = caml_nsvg_map_bundle(filename_s);
+  else
+#endif
+    bundle = caml_nsvg_read_bundle(filename_s);
+  caml_leave_blocking_section();
+  caml_stat_free(filename_s);
+  if (bundle == NULL) CAMLreturn(Val_none);
+  ret = caml_alloc_custom_mem(&caml_nsvg_bundle_ops, sizeof(caml_nsvg_bundle*),
+                              bundle->owner->size);
+  Bundle_val(ret) = bundle;
+  CAMLreturn(caml_alloc_some(ret));
+}
+
+value caml_nsvg_bundle_length(value bundle) {
+  return Val_int(Bundle_val(bundle)->count);
+}
+
+value caml_nsvg_bundle_name(value bundle, value i) {
+  CAMLparam2(bundle, i);
+  caml_nsvg_bundle* bundle_p = Bundle_val(bundle);
+  const caml_nsvg_bundle_entry* e = &bundle_p->entries[Int_val(i)];
+  CAMLreturn(caml_alloc_initialized_string(e->name_len, bundle_p->owner->data + e->name_off));
+}
+
+// The images of a bundle are not charged to the GC: the bundle already is.
+value caml_nsvg_bundle_get(value bundle, value i) {
+  CAMLparam2(bundle, i);
+  caml_nsvg_bundle* bundle_p = Bundle_val(bundle);
+  CAMLreturn(caml_nsvg_alloc_owned_image(bundle_p->images[Int_val(i)], bundle_p->owner, 0));
+}
+
 // Rasterize
 
-value caml_nsvg_create_rasterizer(value unit) {
+value caml_nsvg_create_rasterizer(value simd, value edge_engine,
+                                  value format, value composite) {
   NSVGrasterizer* rast = nsvgCreateRasterizer();
   assert (rast);
+  nsvgRasterizerSetSimd(rast, Bool_val(simd));
+  nsvgRasterizerSetEdgeEngine(rast, Int_val(edge_engine));
+  nsvgRasterizerSetPixelFormat(rast, Int_val(format));
+  nsvgRasterizerSetComposite(rast, Bool_val(composite));
   assert (((uintptr_t) rast & 1) == 0);
   return (value) rast | 1;
 }
 
+value caml_nsvg_rasterizer_stats(value rast) {
+  CAMLparam1(rast);
+  CAMLlocal3(ret, shape_edges, tmp);
+  NSVGrasterizer* rast_p = (NSVGrasterizer*) (Field(rast, 0) & ~1);
+  NSVGrasterStats stats;
+  if (!nsvgRasterizerGetStats(rast_p, &stats))
+    CAMLreturn(Val_none);
+  shape_edges = caml_alloc(stats.shapes, 0);
+  for (int i = 0; i < stats.shapes; i++)
+    Store_field(shape_edges, i, Val_int(stats.shapeEdges[i]));
+  ret = caml_alloc(12, 0);
+  Store_field(ret, 0, shape_edges);
+  Store_field(ret, 1, Val_long(stats.edges));
+  Store_field(ret, 2, Val_int(stats.maxActiveEdges));
+  Store_field(ret, 3, Val_long(stats.scanlines));
+  Store_field(ret, 4, Val_long(stats.pixels));
+  Store_field(ret, 5, Val_int(stats.pages));
+  Store_field(ret, 6, Val_long(stats.edgeBytes));
+  Store_field(ret, 7, Val_long(stats.pointBytes));
+  tmp = caml_copy_double(stats.flattenTime);
+  Store_field(ret, 8, tmp);
+  tmp = caml_copy_double(stats.strokeTime);
+  Store_field(ret, 9, tmp);
+  tmp = caml_copy_double(stats.sortTime);
+  Store_field(ret, 10, tmp);
+  tmp = caml_copy_double(stats.scanlineTime);
+  Store_field(ret, 11, tmp);
+  CAMLreturn(caml_alloc_some(ret));
+}
+
 value caml_nsvg_delete_rasterizer(value rast) {
   NSVGrasterizer* rast_p = (NSVGrasterizer*) (rast & ~1);
   nsvgDeleteRasterizer(rast_p);
   return Val_unit;
 }
 
+// [rast] and [image] are registered as roots so that their finalizers cannot
+// run while the runtime lock is released. The bigarray data lives outside of
+// the OCaml heap and is kept alive by [dst].
+// Only the pixels of the [x0,x1[ x [y0,y1[ rectangle are drawn.
 value caml_nsvg_rasterize_native(value rast, value image,
                                  value tx, value ty, value scale,
-                                 value dst, value w, value h, value stride) {
-  NSVGrasterizer* rast_p = (NSVGrasterizer*) (rast & ~1);
-  NSVGimage* image_p = (NSVGimage*) (image & ~1);
-  nsvgRasterize(rast_p, image_p,
-                (float)Double_val(tx), (float)Double_val(ty), (float)Double_val(scale),
-                (unsigned char*)Caml_ba_data_val(dst),
-                Int_val(w), Int_val(h), Int_val(stride));
+                                 value dst, value w, value h, value stride,
+                                 value x0, value y0, value x1, value y1) {
+  CAMLparam5(rast, image, tx, ty, scale);
+  CAMLxparam4(dst, w, h, stride);
+  CAMLxparam4(x0, y0, x1, y1);
+  NSVGrasterizer* rast_p = (NSVGrasterizer*) (Field(rast, 0) & ~1);
+  NSVGimage* image_p = Image_val(image);
+  float tx_f = (float)Double_val(tx), ty_f = (float)Double_val(ty);
+  float scale_f = (float)Double_val(scale);
+  unsigned char* dst_p = (unsigned char*)Caml_ba_data_val(dst);
+  caml_enter_blocking_section();
+  nsvgRasterizeRegion(rast_p, image_p, tx_f, ty_f, scale_f,
+                      dst_p, Int_val(w), Int_val(h), Int_val(stride),
+                      Int_val(x0), Int_val(y0), Int_val(x1), Int_val(y1));
+  caml_leave_blocking_section();
+  CAMLreturn(Val_unit);
 }
 
 value caml_nsvg_rasterize_bytecode(value* argv, int argn) {
   return caml_nsvg_rasterize_native(argv[0], argv[1], argv[2], argv[3], argv[4],
-                                    argv[5], argv[6], argv[7], argv[8]);
+                                    argv[5], argv[6], argv[7], argv[8],
+                                    argv[9], argv[10], argv[11], argv[12]);
+}
+
+value caml_nsvg_finish(value rast, value dst, value w, value h, value stride) {
+  CAMLparam5(rast, dst, w, h, stride);
+  NSVGrasterizer* rast_p = (NSVGrasterizer*) (Field(rast, 0) & ~1);
+  unsigned char* dst_p = (unsigned char*)Caml_ba_data_val(dst);
+  int w_ = Int_val(w), h_ = Int_val(h);
+  caml_enter_blocking_section();
+  nsvgFinishRegion(rast_p, dst_p, w_, h_, Int_val(stride), 0, 0, w_, h_);
+  caml_leave_blocking_section();
+  CAMLreturn(Val_unit);
+}
+
+// Prepared images are custom blocks holding a pointer to the NSVGprepared.
+// On the OCaml side, they are paired with the image they were prepared from
+// (see nanosvg.ml), which keeps the image alive.
+
+#define Prepared_val(v) (*((NSVGprepared**) Data_custom_val(v)))
+
+static void caml_nsvg_finalize_prepared(value v) {
+  nsvgDeletePrepared(Prepared_val(v));
+}
+
+static struct custom_operations caml_nsvg_prepared_ops = {
+  "nanosvg.prepared",
+  caml_nsvg_finalize_prepared,
+  custom_compare_default,
+  custom_hash_default,
+  custom_serialize_default,
+  custom_deserialize_default,
+  custom_compare_ext_default,
+  custom_fixed_length_default
+};
+
+value caml_nsvg_prepare(value rast, value image, value scale) {
+  CAMLparam3(rast, image, scale);
+  CAMLlocal1(ret);
+  NSVGrasterizer* rast_p = (NSVGrasterizer*) (Field(rast, 0) & ~1);
+  NSVGimage* image_p = Image_val(image);
+  float scale_f = (float)Double_val(scale);
+  NSVGprepared* prepared;
+  caml_enter_blocking_section();
+  prepared = nsvgPrepare(rast_p, image_p, scale_f);
+  caml_leave_blocking_section();
+  if (prepared == NULL) caml_raise_out_of_memory();
+  ret = caml_alloc_custom_mem(&caml_nsvg_prepared_ops, sizeof(NSVGprepared*),
+                              nsvgPreparedSize(prepared));
+  Prepared_val(ret) = prepared;
+  CAMLreturn(ret);
+}
+
+// Prepares the shapes of [image] that can be drawn in the w x h destination
+// at tx, ty, for rasterize_parallel.
+value caml_nsvg_prepare_region_native(value rast, value image,
+                                      value tx, value ty, value scale,
+                                      value w, value h) {
+  CAMLparam5(rast, image, tx, ty, scale);
+  CAMLxparam2(w, h);
+  CAMLlocal1(ret);
+  NSVGrasterizer* rast_p = (NSVGrasterizer*) (Field(rast, 0) & ~1);
+  NSVGimage* image_p = Image_val(image);
+  float tx_f = (float)Double_val(tx), ty_f = (float)Double_val(ty);
+  float scale_f = (float)Double_val(scale);
+  int w_ = Int_val(w), h_ = Int_val(h);
+  NSVGprepared* prepared;
+  caml_enter_blocking_section();
+  prepared = nsvgPrepareRegion(rast_p, image_p, tx_f, ty_f, scale_f, 0, 0, w_, h_);
+  caml_leave_blocking_section();
+  if (prepared == NULL) caml_raise_out_of_memory();
+  ret = caml_alloc_custom_mem(&caml_nsvg_prepared_ops, sizeof(NSVGprepared*),
+                              nsvgPreparedSize(prepared));
+  Prepared_val(ret) = prepared;
+  CAMLreturn(ret);
+}
+
+value caml_nsvg_prepare_region_bytecode(value* argv, int argn) {
+  return caml_nsvg_prepare_region_native(argv[0], argv[1], argv[2], argv[3], argv[4],
+                                         argv[5], argv[6]);
+}
+
+// [prepared] is the OCaml record { img; raw; scale }; it is registered as a
+// root, which keeps both the image and the prepared data alive.
+value caml_nsvg_rasterize_prepared_native(value rast, value prepared,
+                                          value tx, value ty,
+                                          value dst, value w, value h, value stride,
+                                          value x0, value y0, value x1, value y1) {
+  CAMLparam5(rast, prepared, tx, ty, dst);
+  CAMLxparam3(w, h, stride);
+  CAMLxparam4(x0, y0, x1, y1);
+  NSVGrasterizer* rast_p = (NSVGrasterizer*) (Field(rast, 0) & ~1);
+  NSVGprepared* prepared_p = Prepared_val(Field(prepared, 1));
+  float tx_f = (float)Double_val(tx), ty_f = (float)Double_val(ty);
+  unsigned char* dst_p = (unsigned char*)Caml_ba_data_val(dst);
+  caml_enter_blocking_section();
+  nsvgRasterizePrepared(rast_p, prepared_p, tx_f, ty_f,
+                        dst_p, Int_val(w), Int_val(h), Int_val(stride),
+                        Int_val(x0), Int_val(y0), Int_val(x1), Int_val(y1));
+  caml_leave_blocking_section();
+  CAMLreturn(Val_unit);
+}
+
+value caml_nsvg_rasterize_prepared_bytecode(value* argv, int argn) {
+  return caml_nsvg_rasterize_prepared_native(argv[0], argv[1], argv[2], argv[3],
+                                             argv[4], argv[5], argv[6], argv[7],
+                                             argv[8], argv[9], argv[10], argv[11]);
+}
+
+// Draws a band of a prepared image for rasterize_parallel; the bands are
+// finished with caml_nsvg_finish once they are all drawn.
+value caml_nsvg_rasterize_prepared_unfinished_native(value rast, value prepared,
+                                                     value tx, value ty,
+                                                     value dst, value w, value h, value stride,
+                                                     value x0, value y0, value x1, value y1) {
+  CAMLparam5(rast, prepared, tx, ty, dst);
+  CAMLxparam3(w, h, stride);
+  CAMLxparam4(x0, y0, x1, y1);
+  NSVGrasterizer* rast_p = (NSVGrasterizer*) (Field(rast, 0) & ~1);
+  NSVGprepared* prepared_p = Prepared_val(Field(prepared, 1));
+  float tx_f = (float)Double_val(tx), ty_f = (float)Double_val(ty);
+  unsigned char* dst_p = (unsigned char*)Caml_ba_data_val(dst);
+  caml_enter_blocking_section();
+  nsvgRasterizePreparedUnfinished(rast_p, prepared_p, tx_f, ty_f,
+                                  dst_p, Int_val(w), Int_val(h), Int_val(stride),
+                                  Int_val(x0), Int_val(y0), Int_val(x1), Int_val(y1));
+  caml_leave_blocking_section();
+  CAMLreturn(Val_unit);
+}
+
+value caml_nsvg_rasterize_prepared_unfinished_bytecode(value* argv, int argn) {
+  return caml_nsvg_rasterize_prepared_unfinished_native(argv[0], argv[1], argv[2], argv[3],
+                                                        argv[4], argv[5], argv[6], argv[7],
+                                                        argv[8], argv[9], argv[10], argv[11]);
+}
+
+// Spatial indices are custom blocks holding a pointer to the NSVGindex. On
+// the OCaml side, they are paired with their image in the record
+// { img; raw }, which keeps the image alive.
+
+#define Index_val(v) (*((NSVGindex**) Data_custom_val(v)))
+#define Index_record_val(v) Index_val(Field(v, 1))
+
+static void caml_nsvg_finalize_index(value v) {
+  nsvgDeleteIndex(Index_val(v));
+}
+
+static struct custom_operations caml_nsvg_index_ops = {
+  "nanosvg.index",
+  caml_nsvg_finalize_index,
+  custom_compare_default,
+  custom_hash_default,
+  custom_serialize_default,
+  custom_deserialize_default,
+  custom_compare_ext_default,
+  custom_fixed_length_default
+};
+
+value caml_nsvg_index_create(value image) {
+  CAMLparam1(image);
+  CAMLlocal1(ret);
+  NSVGimage* image_p = Image_val(image);
+  NSVGindex* index;
+  caml_enter_blocking_section();
+  index = nsvgCreateIndex(image_p);
+  caml_leave_blocking_section();
+  if (index == NULL) caml_raise_out_of_memory();
+  ret = caml_alloc_custom_mem(&caml_nsvg_index_ops, sizeof(NSVGindex*),
+                              nsvgIndexSize(index));
+  Index_val(ret) = index;
+  CAMLreturn(ret);
+}
+
+value caml_nsvg_index_length(value index) {
+  return Val_int(nsvgIndexShapeCount(Index_record_val(index)));
+}
+
+value caml_nsvg_index_shape(value index, value i) {
+  CAMLparam2(index, i);
+  NSVGshape* shape = nsvgIndexShape(Index_record_val(index), Int_val(i));
+  if (shape == NULL) caml_invalid_argument("Nanosvg.Index.shape");
+  CAMLreturn(caml_nsvg_alloc_cursor(Field(index, 0), shape));
+}
+
+// Queries first write into a buffer on the stack, and are run again with a
+// large enough buffer if there are more results.
+
+#define CAML_NSVG_QUERY_BUF 256
+
+static value caml_nsvg_int_array(int* xs, int n) {
+  value ret;
+  int i;
+  if (n == 0) return Atom(0);
+  ret = caml_alloc(n, 0);
+  for (i = 0; i < n; i++) Field(ret, i) = Val_int(xs[i]);
+  return ret;
+}
+
+value caml_nsvg_index_query_rect(value index, value box) {
+  CAMLparam2(index, box);
+  CAMLlocal1(ret);
+  NSVGindex* index_p = Index_record_val(index);
+  float x0 = (float)Double_field(box, 0), y0 = (float)Double_field(box, 1);
+  float x1 = (float)Double_field(box, 2), y1 = (float)Double_field(box, 3);
+  int buf[CAML_NSVG_QUERY_BUF];
+  int n = nsvgIndexQueryRect(index_p, x0, y0, x1, y1, buf, CAML_NSVG_QUERY_BUF);
+  if (n <= CAML_NSVG_QUERY_BUF) {
+    ret = caml_nsvg_int_array(buf, n);
+  } else {
+    int* big = (int*)malloc(sizeof(int) * n);
+    if (big == NULL) caml_raise_out_of_memory();
+    nsvgIndexQueryRect(index_p, x0, y0, x1, y1, big, n);
+    ret = caml_nsvg_int_array(big, n);
+    free(big);
+  }
+  CAMLreturn(ret);
+}
+
+value caml_nsvg_index_query_point(value index, value x, value y, value tol) {
+  CAMLparam4(index, x, y, tol);
+  CAMLlocal1(ret);
+  NSVGindex* index_p = Index_record_val(index);
+  float x_f = (float)Double_val(x), y_f = (float)Double_val(y);
+  float tol_f = (float)Double_val(tol);
+  int buf[CAML_NSVG_QUERY_BUF];
+  int n = nsvgIndexQueryPoint(index_p, x_f, y_f, tol_f, buf, CAML_NSVG_QUERY_BUF);
+  if (n <= CAML_NSVG_QUERY_BUF) {
+    ret = caml_nsvg_int_array(buf, n);
+  } else {
+    int* big = (int*)malloc(sizeof(int) * n);
+    if (big == NULL) caml_raise_out_of_memory();
+    nsvgIndexQueryPoint(index_p, x_f, y_f, tol_f, big, n);
+    ret = caml_nsvg_int_array(big, n);
+    free(big);
+  }
+  CAMLreturn(ret);
+}
+
+value caml_nsvg_index_pick(value index, value x, value y, value tol) {
+  return Val_int(nsvgIndexPick(Index_record_val(index), (float)Double_val(x),
+                               (float)Double_val(y), (float)Double_val(tol)));
+}
+
+value caml_nsvg_shape_fill_contains(value shape, value x, value y) {
+  return Val_bool(nsvgShapeFillContains(Shape_ptr_val(shape), (float)Double_val(x),
+                                        (float)Double_val(y)));
+}
+
+value caml_nsvg_shape_stroke_contains(value shape, value x, value y, value tol) {
+  return Val_bool(nsvgShapeStrokeContains(Shape_ptr_val(shape), (float)Double_val(x),
+                                          (float)Double_val(y), (float)Double_val(tol)));
 }
@@ -1,7 +1,124 @@
-(* Text rendering is not optimized:
-   - there is no caching of glyph bitmaps
-   - no attempt is made of reusing buffers to limit allocations
-*)
+(* Glyph bitmaps are cached (see [Glyph_cache]); the glyphs of a text node are
+   merged into a coverage buffer that is reused between text nodes, which is
+   then composited onto the destination. Both loops are done in C. *)
+
+type bitmap = (int, Bigarray.int8_unsigned_elt, Bigarray.c_layout) Bigarray.Array1.t
+
+external coverage_ :
+  bitmap -> int -> int -> bitmap -> int -> int -> int -> int -> unit
+  = "caml_nsvg_text_coverage_bytecode" "caml_nsvg_text_coverage_native" [@@noalloc]
+
+external blend_ :
+  Nanosvg.data8 -> int -> int -> bitmap -> int -> int -> int -> int -> int -> unit
+  = "caml_nsvg_text_blend_bytecode" "caml_nsvg_text_blend_native" [@@noalloc]
+
+(* Glyphs are positioned with a precision of 1/subpixel_steps of a pixel *)
+let subpixel_steps = 4
+
+module Glyph_cache = struct
+  (* font (see [font_id]), glyph, scale, subpixel shift (in 1/subpixel_steps of
+     a pixel) *)
+  type key = int * Stb_truetype.glyph * float * int
+
+  type entry = {
+    mutable key : key;
+    mutable bitmap : Stb_truetype.glyph_bitmap;
+    mutable used : bool; (* since the clock hand last went past the entry *)
+  }
+
+  (* Fonts are identified by physical equality, and do not stay alive because
+     of the cache. *)
+  module Fonts = Ephemeron.K1.Make (struct
+    type t = Stb_truetype.t
+    let equal = ( == )
+    let hash = Hashtbl.hash
+  end)
+
+  (* Once the cache is full, glyphs are evicted with the clock algorithm: the
+     entries form a ring, and the hand moves forward to the first entry that
+     has not been used since the hand last went past it. *)
+  type t = {
+    max_glyphs : int;
+    fonts : int Fonts.t;
+    mutable next_font : int;
+    glyphs : (key, entry) Hashtbl.t;
+    mutable ring : entry array; (* the first [length] entries are in use *)
+    mutable hand : int;
+    mutable coverage : bitmap;
+  }
+
+  let create ?(max_glyphs = 4096) () = {
+    max_glyphs;
+    fonts = Fonts.create 8; next_font = 0;
+    glyphs = Hashtbl.create 256;
+    ring = [||]; hand = 0;
+    coverage = Bigarray.Array1.create Bigarray.int8_unsigned Bigarray.c_layout 0;
+  }
+
+  let clear c =
+    Hashtbl.reset c.glyphs;
+    Fonts.reset c.fonts;
+    c.ring <- [||]; c.hand <- 0
+
+  let length c = Hashtbl.length c.glyphs
+
+  (* Ids are not reused, so that the glyphs of a collected font are never
+     taken for the ones of another font; they leave the cache as it turns
+     over. *)
+  let font_id c font =
+    match Fonts.find_opt c.fonts font with
+    | Some i -> i
+    | None ->
+      let i = c.next_font in
+      Fonts.replace c.fonts font i;
+      c.next_font <- i + 1;
+      i
+
+  let rec evict c =
+    let e = c.ring.(c.hand) in
+    c.hand <- (c.hand + 1) mod Hashtbl.length c.glyphs;
+    if e.used then begin
+      e.used <- false;
+      evict c
+    end else e
+
+  let add c key bitmap =
+    let n = Hashtbl.length c.glyphs in
+    if n < c.max_glyphs then begin
+      let e = { key; bitmap; used = false } in
+      if n = Array.length c.ring then begin
+        let ring = Array.make (min c.max_glyphs (max 16 (2 * n))) e in
+        Array.blit c.ring 0 ring 0 n;
+        c.ring <- ring
+      end;
+      c.ring.(n) <- e;
+      Hashtbl.add c.glyphs key e
+    end else if n > 0 then begin
+      let e = evict c in
+      Hashtbl.remove c.glyphs e.key;
+      e.key <- key; e.bitmap <- bitmap;
+      Hashtbl.add c.glyphs key e
+    end
+
+  let get c font_id font glyph ~scale ~shift =
+    let key = (font_id, glyph, scale, shift) in
+    match Hashtbl.find_opt c.glyphs key with
+    | Some e -> e.used <- true; e.bitmap
+    | None ->
+      let shift_x = float shift /. float subpixel_steps in
+      let bitmap =
+        Stb_truetype.get_glyph_bitmap_subpixel font glyph ~scale_x:scale ~scale_y:scale
+          ~shift_x ~shift_y:0. in
+      add c key bitmap;
+      bitmap
+
+  let coverage c size =
+    if Bigarray.Array1.dim c.coverage < size then
+      c.coverage <- Bigarray.Array1.create Bigarray.int8_unsigned Bigarray.c_layout size;
+    let buf = Bigarray.Array1.sub c.coverage 0 size in
+    Bigarray.Array1.fill buf 0;
+    buf
+end
 
 let box_merge box1 box2 =
   Stb_truetype.{
@@ -11,7 +128,7 @@ let box_merge box1 box2 =
     y1 = max box1.y1 box2.y1;
   }
 
-let prerender_glyphs font scale (l: Stb_truetype.glyph list) =
+let prerender_glyphs cache font scale (l: Stb_truetype.glyph list) =
   let rec with_kerning = function
     | x :: y :: xs ->
       let kern = Stb_truetype.kern_advance font x y in
@@ -20,14 +137,14 @@ let prerender_glyphs font scale (l: Stb_truetype.glyph list) =
     | [] -> []
   in
   let l = with_kerning l in
+  let font_id = Glyph_cache.font_id cache font in
   let xpos = ref 0. in
   List.map (fun (glyph, kern) ->
-    let shift_x = !xpos -. Float.floor !xpos in
+    let q = int_of_float (Float.round (!xpos *. float subpixel_steps)) in
+    let shift = q land (subpixel_steps - 1) in
     let hmetrics = Stb_truetype.hmetrics font glyph in
-    let bitmap =
-      Stb_truetype.get_glyph_bitmap_subpixel font glyph ~scale_x:scale ~scale_y:scale
-        ~shift_x ~shift_y:0. in
-    let x = int_of_float !xpos + bitmap.xoff in
+    let bitmap = Glyph_cache.get cache font_id font glyph ~scale ~shift in
+    let x = (q - shift) / subpixel_steps + bitmap.xoff in
     let y = bitmap.yoff in
     xpos := !xpos +. scale *. (float hmetrics.advance_width +. float kern);
     (bitmap, x, y)
@@ -42,34 +159,19 @@ let glyphs_box (glyphs: (Stb_truetype.glyph_bitmap * int * int) list) =
   | [] -> None
   | g :: gs -> Some (List.fold_left box_merge g gs)
 
-let render_glyphs font scale (l: Stb_truetype.glyph list) =
-  let gs = prerender_glyphs font scale l in
+(* The returned bitmap is only valid until the next use of [cache] *)
+let render_glyphs cache font scale (l: Stb_truetype.glyph list) =
+  let gs = prerender_glyphs cache font scale l in
   match glyphs_box gs with
-  | None ->
-    Stb_truetype.{
-      buf = Bigarray.Array1.create Bigarray.int8_unsigned Bigarray.c_layout 0;
-      w = 0; h = 0; xoff = 0; yoff = 0
-    }
+  | None -> None
   | Some text_box ->
     let w = text_box.x1 - text_box.x0 in
     let h = text_box.y1 - text_box.y0 in
-    let buf = Bigarray.Array1.create Bigarray.int8_unsigned Bigarray.c_layout (w * h) in
-    Bigarray.Array1.fill buf 0;
+    let buf = Glyph_cache.coverage cache (w * h) in
     List.iter (fun ((bitmap: Stb_truetype.glyph_bitmap), x, y) ->
-      let dx = x - text_box.x0 in
-      let dy = y - text_box.y0 in
-      for j = 0 to bitmap.h - 1 do
-        for i = 0 to bitmap.w - 1 do
-          let text_i = i+dx and text_j = j+dy in
-          if 0 <= text_i && text_i < w && 0 <= text_j && text_j < h then (
-            let a0 = buf.{text_j * w + text_i} in
-            let a1 = bitmap.buf.{j * bitmap.w + i} in
-            buf.{text_j * w + text_i} <- a0 + a1 - (a0 * a1) / 255 (* alpha blending *)
-          )
-        done
-      done
+      coverage_ buf w h bitmap.buf bitmap.w bitmap.h (x - text_box.x0) (y - text_box.y0)
     ) gs;
-    Stb_truetype.{ buf; w; h; xoff = text_box.x0; yoff = text_box.y0 }
+    Some Stb_truetype.{ buf; w; h; xoff = text_box.x0; yoff = text_box.y0 }
 
 let glyphs_of_string font s =
   String.to_seq s
@@ -78,6 +180,7 @@ let glyphs_of_string font s =
   |> List.of_seq
 
 let rasterize_text
+    ?cache
     (svg: Nanosvg.image)
     ~(get_font: family:string -> Stb_truetype.t)
     ~(dst: Nanosvg.data8)
@@ -86,6 +189,9 @@ let rasterize_text
     ~(w: int) ~(h: int)
     ()
   =
+  if Bigarray.Array1.dim dst < w * h * 4 then
+    invalid_arg "Nanosvg_text.rasterize_text: destination buffer too small";
+  let cache = match cache with Some c -> c | None -> Glyph_cache.create () in
   List.iter (fun shape ->
     match shape.Nanosvg.payload with
     | Shape_paths _ -> ()
@@ -101,46 +207,24 @@ let rasterize_text
         let font = get_font ~family:txt.fontfamily in
         let text_scale = txt.xform.(0) *. scale in
         let scale = Stb_truetype.scale_for_mapping_em_to_pixels font (text_scale *. txt.fontsize) in
-        let bitmap = render_glyphs font scale (glyphs_of_string font txt.s) in
-
-        let anchor_x = int_of_float (tx +. text_scale *. txt.xform.(4)) in
-        let anchor_y = int_of_float (ty +. text_scale *. txt.xform.(5)) in
-        let anchor_dx, anchor_dy =
-          match txt.anchor with
-          | Anchor_left -> 0, bitmap.yoff
-          | Anchor_center -> -bitmap.w/2, bitmap.yoff
-          | Anchor_right -> -bitmap.w, bitmap.yoff
-        in
-        let text_x, text_y = anchor_x + anchor_dx, anchor_y + anchor_dy in
-
-        let text_r, text_g, text_b =
-          match shape.Nanosvg.fill with
-          | Paint_color col ->
-            Int32.(logand col 0xffl |> to_int,
-                   logand (shift_right col 8) 0xffl |> to_int,
-                   logand (shift_right col 16) 0xffl |> to_int)
-          | _ -> (0,0,0)
-        in
-
-        for j = 0 to bitmap.h - 1 do
-          for i = 0 to bitmap.w - 1 do
-            let dst_i = i+text_x and dst_j = j+text_y in
-            if 0 <= dst_i && dst_i < w && 0 <= dst_j && dst_j < h then (
-              (* alpha blending *)
-              let off = (dst_j * w + dst_i) * 4 in
-              let adst = dst.{off + 3} in
-              let atext = bitmap.buf.{j * bitmap.w + i} in
-              let ares = adst + atext - (adst * atext) / 255 in
-              let col cdst ctext =
-                if ares = 0 then 0 else
-                  (ctext * atext + cdst * adst - cdst * atext * adst / 255) / ares
-              in
-              dst.{off} <- col dst.{off} text_r;
-              dst.{off + 1} <- col dst.{off+1} text_g;
-              dst.{off + 2} <- col dst.{off+2} text_b;
-              dst.{off + 3} <- ares
-            )
-          done
-        done
+        match render_glyphs cache font scale (glyphs_of_string font txt.s) with
+        | None -> ()
+        | Some bitmap ->
+          let anchor_x = int_of_float (tx +. text_scale *. txt.xform.(4)) in
+          let anchor_y = int_of_float (ty +. text_scale *. txt.xform.(5)) in
+          let anchor_dx, anchor_dy =
+            match txt.anchor with
+            | Anchor_left -> 0, bitmap.yoff
+            | Anchor_center -> -bitmap.w/2, bitmap.yoff
+            | Anchor_right -> -bitmap.w, bitmap.yoff
+          in
+          let text_x, text_y = anchor_x + anchor_dx, anchor_y + anchor_dy in
+
+          let text_rgb =
+            match shape.Nanosvg.fill with
+            | Paint_color col -> Int32.(logand col 0xffffffl |> to_int)
+            | _ -> 0
+          in
+          blend_ dst w h bitmap.buf bitmap.w bitmap.h text_x text_y text_rgb
       end
   ) svg.shapes
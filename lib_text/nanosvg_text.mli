@@ -1,4 +1,29 @@
+(** Caches of rendered glyph bitmaps, keyed by font, glyph, pixel size and
+    subpixel position. Passing the same cache to successive calls of
+    {!rasterize_text} avoids rendering the same glyphs again. A cache must not
+    be used by several domains at the same time. *)
+module Glyph_cache : sig
+  type t
+
+  (** The cache holds at most [max_glyphs] glyphs (default: 4096); past that,
+      the glyphs that were not used recently are evicted one at a time. Fonts
+      are compared by physical equality, so [get_font] should return the same
+      value for a given family. The cache does not keep fonts alive. *)
+  val create : ?max_glyphs:int -> unit -> t
+
+  (** Empties the cache, releasing the glyphs it holds. *)
+  val clear : t -> unit
+
+  (** Number of glyphs in the cache. *)
+  val length : t -> int
+end
+
+(** Draws the text shapes of an image over [dst], an RGBA image of size
+    [w * h]. Without [cache], glyphs are only cached during the call.
+
+    Raises [Invalid_argument] if [dst] is smaller than [w * h * 4] bytes. *)
 val rasterize_text :
+  ?cache:Glyph_cache.t ->
   Nanosvg.image ->
   get_font:(family:string -> Stb_truetype.t) ->
   dst:Nanosvg.data8 ->
@@ -0,0 +1,84 @@
+#define CAML_NAME_SPACE
+#include <caml/mlvalues.h>
+#include <caml/bigarray.h>
+
+// Both functions clip the source bitmap to the destination, and the OCaml
+// side checks that the bigarrays are large enough for the given sizes, so no
+// bounds checks are needed in the inner loops. Row pointers are only formed
+// for the clipped part of the rows, which is inside both bitmaps. They neither
+// allocate nor raise.
+
+// Merges the 8-bit coverage bitmap [src] (sw x sh) into [dst] (dw x dh) at
+// (x, y), using the "union" of the two coverages.
+value caml_nsvg_text_coverage_native(value dst, value dw, value dh,
+                                     value src, value sw, value sh,
+                                     value x, value y) {
+  unsigned char* d = (unsigned char*)Caml_ba_data_val(dst);
+  const unsigned char* s = (const unsigned char*)Caml_ba_data_val(src);
+  long dw_ = Long_val(dw), dh_ = Long_val(dh);
+  long sw_ = Long_val(sw), sh_ = Long_val(sh);
+  long x_ = Long_val(x), y_ = Long_val(y);
+  long i0 = x_ < 0 ? -x_ : 0, i1 = x_ + sw_ > dw_ ? dw_ - x_ : sw_;
+  long j0 = y_ < 0 ? -y_ : 0, j1 = y_ + sh_ > dh_ ? dh_ - y_ : sh_;
+  long i, j;
+  if (i0 >= i1) return Val_unit;
+  for (j = j0; j < j1; j++) {
+    unsigned char* drow = d + (y_ + j) * dw_ + x_ + i0;
+    const unsigned char* srow = s + j * sw_ + i0;
+    for (i = 0; i < i1 - i0; i++) {
+      int a0 = drow[i], a1 = srow[i];
+      drow[i] = (unsigned char)(a0 + a1 - (a0 * a1) / 255);
+    }
+  }
+  return Val_unit;
+}
+
+value caml_nsvg_text_coverage_bytecode(value* argv, int argn) {
+  return caml_nsvg_text_coverage_native(argv[0], argv[1], argv[2], argv[3],
+                                        argv[4], argv[5], argv[6], argv[7]);
+}
+
+// Composites the coverage bitmap [cov] (cw x ch), painted with the color
+// [rgb] (0xBBGGRR), over the RGBA image [dst] (w x h) at (x, y). Pixels of
+// [dst] are not premultiplied.
+value caml_nsvg_text_blend_native(value dst, value w, value h,
+                                  value cov, value cw, value ch,
+                                  value x, value y, value rgb) {
+  unsigned char* d = (unsigned char*)Caml_ba_data_val(dst);
+  const unsigned char* c = (const unsigned char*)Caml_ba_data_val(cov);
+  long w_ = Long_val(w), h_ = Long_val(h);
+  long cw_ = Long_val(cw), ch_ = Long_val(ch);
+  long x_ = Long_val(x), y_ = Long_val(y);
+  long rgb_ = Long_val(rgb);
+  int col[3] = { rgb_ & 0xff, (rgb_ >> 8) & 0xff, (rgb_ >> 16) & 0xff };
+  long i0 = x_ < 0 ? -x_ : 0, i1 = x_ + cw_ > w_ ? w_ - x_ : cw_;
+  long j0 = y_ < 0 ? -y_ : 0, j1 = y_ + ch_ > h_ ? h_ - y_ : ch_;
+  long i, j;
+  int k;
+  if (i0 >= i1) return Val_unit;
+  for (j = j0; j < j1; j++) {
+    unsigned char* drow = d + ((y_ + j) * w_ + x_ + i0) * 4;
+    const unsigned char* crow = c + j * cw_ + i0;
+    for (i = 0; i < i1 - i0; i++) {
+      unsigned char* p = drow + i * 4;
+      int atext = crow[i], adst = p[3], ares;
+      if (atext == 0) {
+        // same result as the general case, without the divisions
+        if (adst == 0) p[0] = p[1] = p[2] = 0;
+        continue;
+      }
+      ares = adst + atext - (adst * atext) / 255;
+      for (k = 0; k < 3; k++)
+        p[k] = (unsigned char)
+          ((col[k] * atext + p[k] * adst - p[k] * atext * adst / 255) / ares);
+      p[3] = (unsigned char)ares;
+    }
+  }
+  return Val_unit;
+}
+
+value caml_nsvg_text_blend_bytecode(value* argv, int argn) {
+  return caml_nsvg_text_blend_native(argv[0], argv[1], argv[2], argv[3],
+                                     argv[4], argv[5], argv[6], argv[7],
+                                     argv[8]);
+}
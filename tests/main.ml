@@ -37,11 +37,380 @@ let use_svg (img: Nanosvg.image) =
       use_text txt
   ) img.shapes
 
+(* rendering in parallel must give the same pixels as rendering at once *)
+let check_parallel raw =
+  let w = int_of_float (Nanosvg.Image_data.width raw *. 1.5) + 1 in
+  let h = int_of_float (Nanosvg.Image_data.height raw *. 1.5) + 1 in
+  List.iter (fun format ->
+    let rs = Array.init 3 (fun _ -> Nanosvg.Rasterizer.create ~format ()) in
+    let size = w * h * Nanosvg.Rasterizer.bytes_per_pixel rs.(0) in
+    let full = Bigarray.(Array1.create int8_unsigned c_layout size) in
+    Nanosvg.rasterize rs.(0) raw ~tx:0.5 ~ty:0.25 ~scale:1.5 ~dst:full ~w ~h ();
+    List.iter (fun bands ->
+      let dst = Bigarray.(Array1.create int8_unsigned c_layout size) in
+      Nanosvg.rasterize_parallel rs raw ~tx:0.5 ~ty:0.25 ~scale:1.5 ~dst ~w ~h ?bands ();
+      assert (dst = full)
+    ) [None; Some 1; Some 7]
+  ) Nanosvg.Rasterizer.[Pixel_rgba; Pixel_rgba_premultiplied; Pixel_a8];
+  let r = Nanosvg.Rasterizer.create () in
+  let dst = Bigarray.(Array1.create int8_unsigned c_layout (w * h * 4)) in
+  match Nanosvg.rasterize_parallel [| r; r |] raw ~tx:0. ~ty:0. ~scale:1. ~dst ~w ~h () with
+  | () -> assert false
+  | exception Invalid_argument _ -> ()
+
+(* drawing a region over a full rendering must give back the same pixels *)
+let check_region raw =
+  let scale = 2. and tx = 1. and ty = -1. in
+  let w = int_of_float (Nanosvg.Image_data.width raw *. scale) + 3 in
+  let h = int_of_float (Nanosvg.Image_data.height raw *. scale) + 1 in
+  let r = Nanosvg.Rasterizer.create () in
+  let full = Bigarray.(Array1.create int8_unsigned c_layout (w * h * 4)) in
+  Nanosvg.rasterize r raw ~tx ~ty ~scale ~dst:full ~w ~h ();
+  let dst = Bigarray.(Array1.create int8_unsigned c_layout (w * h * 4)) in
+  let st = Random.State.make [| 2 |] in
+  for _ = 1 to 10 do
+    let x0 = Random.State.int st w and y0 = Random.State.int st h in
+    let x1 = x0 + 1 + Random.State.int st (w - x0) in
+    let y1 = y0 + 1 + Random.State.int st (h - y0) in
+    Bigarray.Array1.blit full dst;
+    for y = y0 to y1 - 1 do
+      Bigarray.Array1.fill (Bigarray.Array1.sub dst ((y * w + x0) * 4) ((x1 - x0) * 4)) 0xab
+    done;
+    (* the pixel coordinates are exact in the coordinates of the image *)
+    let region = Nanosvg.{ minx = (float x0 -. tx) /. scale; miny = (float y0 -. ty) /. scale;
+                           maxx = (float x1 -. tx) /. scale; maxy = (float y1 -. ty) /. scale } in
+    Nanosvg.rasterize_region r raw ~region ~tx ~ty ~scale ~dst ~w ~h ();
+    assert (dst = full)
+  done
+
+(* the lazy accessors must agree with the lifted image *)
+let check_lazy (raw: Nanosvg.Image_data.t) (img: Nanosvg.image) =
+  let open Nanosvg in
+  let shapes = Shape.fold (fun acc s -> s :: acc) [] raw |> List.rev in
+  assert (List.length shapes = List.length img.shapes);
+  List.iter2 (fun s (ls: shape) ->
+    assert (Shape.id s = ls.id);
+    assert (Shape.bounds s = ls.bounds);
+    assert (Shape.fill s = ls.fill);
+    assert (Shape.visible s = ls.visible);
+    match ls.payload, Shape.text s with
+    | Shape_text txt, Some txt' -> assert (txt = txt')
+    | Shape_paths ps, None ->
+      let paths = ref [] in
+      Shape.iter_paths (fun p -> paths := p :: !paths) s;
+      List.iter2 (fun p (lp: path) ->
+        let pts = Path.points p in
+        assert (Path.closed p = lp.closed);
+        assert (Bigarray.Array1.dim pts = 2 * Array.length lp.points);
+        Array.iteri (fun i pt ->
+          assert (pts.{2*i} = pt.x && pts.{2*i+1} = pt.y)
+        ) lp.points;
+        assert (Path.npoints p = Array.length lp.points);
+        Array.iteri (fun i pt ->
+          assert (Path.x p i = pt.x && Path.y p i = pt.y)
+        ) lp.points;
+        let i = ref 0 in
+        Path.iter_points (fun x y ->
+          assert (x = lp.points.(!i).x && y = lp.points.(!i).y);
+          incr i
+        ) p;
+        assert (!i = Array.length lp.points);
+        (match Path.x p (Path.npoints p) with
+         | _ -> assert false
+         | exception Invalid_argument _ -> ());
+        (* the points are a copy *)
+        if Bigarray.Array1.dim pts > 0 then begin
+          pts.{0} <- pts.{0} +. 1.;
+          assert ((Path.points p).{0} = lp.points.(0).x)
+        end
+      ) (List.rev !paths) ps
+    | _ -> assert false
+  ) shapes img.shapes
+
+(* all the ways of parsing a file must produce the same image *)
+let check_parse_modes filename img =
+  let data = In_channel.with_open_bin filename In_channel.input_all in
+  let buf = Bigarray.(Array1.create char c_layout (String.length data)) in
+  String.iteri (fun i c -> buf.{i} <- c) data;
+  let same raw = assert (Nanosvg.lift (Option.get raw) = img) in
+  same (Nanosvg.parse data);
+  same (Nanosvg.parse_from_file ~mmap:true filename);
+  same (Nanosvg.parse_bigstring buf);
+  same (Nanosvg.parse_bigstring ~in_place:true buf)
+
+(* the vector compositing kernels, the edge engines and prepared images must
+   all give the same pixels as the scalar reference *)
+let check_rasterizers raw =
+  let render ?simd ?edge_engine ?(prepared = false) scale =
+    let w = int_of_float (Nanosvg.Image_data.width raw *. scale) + 3 in
+    let h = int_of_float (Nanosvg.Image_data.height raw *. scale) + 1 in
+    let dst = Bigarray.(Array1.create int8_unsigned c_layout (w * h * 4)) in
+    let r = Nanosvg.Rasterizer.create ?simd ?edge_engine () in
+    if prepared then
+      Nanosvg.rasterize_prepared r (Nanosvg.Prepared.create r raw ~scale)
+        ~tx:1.25 ~ty:(-0.5) ~dst ~w ~h ()
+    else
+      Nanosvg.rasterize r raw ~tx:1.25 ~ty:(-0.5) ~scale ~dst ~w ~h ();
+    (* only available in profiling builds *)
+    Option.iter (fun (s: Nanosvg.Rasterizer.stats) ->
+      assert (Array.fold_left (+) 0 s.shape_edges = s.edges);
+      assert (s.pixels <= s.scanlines * w)
+    ) (Nanosvg.Rasterizer.stats r);
+    dst in
+  List.iter (fun scale ->
+    let reference = render ~simd:false scale in
+    assert (render ~simd:true scale = reference);
+    assert (render ~edge_engine:Nanosvg.Rasterizer.Edge_engine_radix scale = reference);
+    assert (render ~prepared:true scale = reference)
+  ) [0.5; 1.; 2.3]
+
+(* all pixel formats must give the same pixels, up to the channel order and
+   the premultiplication; drawing over a transparent destination must be the
+   same as clearing it *)
+let check_formats raw =
+  let w = int_of_float (Nanosvg.Image_data.width raw) + 1 in
+  let h = int_of_float (Nanosvg.Image_data.height raw) + 1 in
+  let render ?composite ?init format =
+    let r = Nanosvg.Rasterizer.create ~format ?composite () in
+    let size = w * h * Nanosvg.Rasterizer.bytes_per_pixel r in
+    let dst = Bigarray.(Array1.create int8_unsigned c_layout size) in
+    (match init with
+     | Some init -> Bigarray.Array1.blit init dst
+     | None -> Bigarray.Array1.fill dst 0xab);
+    Nanosvg.rasterize r raw ~tx:0. ~ty:0. ~scale:1. ~dst ~w ~h ();
+    dst in
+  let open Nanosvg.Rasterizer in
+  let rgba = render Pixel_rgba and pre = render Pixel_rgba_premultiplied in
+  let bgra = render Pixel_bgra and bgra_pre = render Pixel_bgra_premultiplied in
+  let a8 = render Pixel_a8 in
+  for i = 0 to w * h - 1 do
+    let a = pre.{4*i+3} in
+    assert (rgba.{4*i+3} = a && a8.{i} = a);
+    for c = 0 to 2 do
+      assert (pre.{4*i+c} <= a);
+      assert (bgra.{4*i+c} = rgba.{4*i+2-c});
+      assert (bgra_pre.{4*i+c} = pre.{4*i+2-c});
+      if a > 0 then assert (rgba.{4*i+c} = pre.{4*i+c} * 255 / a)
+    done
+  done;
+  let zeros n = Bigarray.(Array1.init int8_unsigned c_layout n (fun _ -> 0)) in
+  assert (render ~composite:true ~init:(zeros (w * h * 4)) Pixel_rgba = rgba);
+  assert (render ~composite:true ~init:(zeros (w * h * 4)) Pixel_rgba_premultiplied = pre);
+  assert (render ~composite:true ~init:(zeros (w * h)) Pixel_a8 = a8);
+  let opaque = Bigarray.(Array1.init int8_unsigned c_layout (w * h * 4)
+                           (fun i -> if i mod 4 = 3 then 255 else 0x40)) in
+  let over = render ~composite:true ~init:opaque Pixel_rgba_premultiplied in
+  for i = 0 to w * h - 1 do assert (over.{4*i+3} = 255) done;
+  (* over a translucent straight background, the pixels outside the shapes
+     keep their color, and the others match the premultiplied blend *)
+  let straight = Bigarray.(Array1.init int8_unsigned c_layout (w * h * 4)
+                             (fun i -> [|200; 100; 50; 77|].(i mod 4))) in
+  let premultiplied = Bigarray.(Array1.init int8_unsigned c_layout (w * h * 4)
+                                  (fun i -> [|60; 30; 15; 77|].(i mod 4))) in
+  let over = render ~composite:true ~init:straight Pixel_rgba in
+  let over_pre = render ~composite:true ~init:premultiplied Pixel_rgba_premultiplied in
+  for i = 0 to w * h - 1 do
+    if a8.{i} = 0 then
+      for c = 0 to 3 do assert (over.{4*i+c} = straight.{4*i+c}) done
+    else begin
+      let a = over_pre.{4*i+3} in
+      assert (over.{4*i+3} = a);
+      for c = 0 to 2 do
+        assert (abs (over.{4*i+c} - over_pre.{4*i+c} * 255 / a) <= 12)
+      done
+    end
+  done
+
+(* serialized images and bundles must give back the same image, and the same
+   pixels *)
+let check_serialization raw img =
+  let render raw =
+    let w = int_of_float (Nanosvg.Image_data.width raw) + 1 in
+    let h = int_of_float (Nanosvg.Image_data.height raw) + 1 in
+    let dst = Bigarray.(Array1.create int8_unsigned c_layout (w * h * 4)) in
+    let r = Nanosvg.Rasterizer.create () in
+    Nanosvg.rasterize r raw ~tx:0. ~ty:0. ~scale:1. ~dst ~w ~h ();
+    dst in
+  let same raw' =
+    assert (Nanosvg.lift raw' = img);
+    assert (render raw' = render raw) in
+  let data = Nanosvg.Image_data.to_bytes raw in
+  same (Option.get (Nanosvg.Image_data.of_bytes data));
+  let corrupted = Bytes.copy data in
+  Bytes.set corrupted 40 (Char.chr (Char.code (Bytes.get corrupted 40) lxor 1));
+  assert (Nanosvg.Image_data.of_bytes corrupted = None);
+  assert (Nanosvg.Image_data.of_bytes (Bytes.sub data 0 (Bytes.length data - 8)) = None);
+  let filename = Filename.temp_file "nanosvg" ".bundle" in
+  Nanosvg.Bundle.save filename ["a", raw; "bb", raw];
+  List.iter (fun mmap ->
+    let b = Option.get (Nanosvg.Bundle.load ~mmap filename) in
+    assert (Nanosvg.Bundle.length b = 2);
+    assert (Nanosvg.Bundle.name b 1 = "bb");
+    same (Nanosvg.Bundle.get b 0);
+    same (Option.get (Nanosvg.Bundle.find b "bb"));
+    assert (Nanosvg.Bundle.find b "c" = None);
+    (* changes made through one image of an entry reach the targets built on
+       another image of the same entry *)
+    let w = int_of_float (Nanosvg.Image_data.width raw) + 1 in
+    let h = int_of_float (Nanosvg.Image_data.height raw) + 1 in
+    let r = Nanosvg.Rasterizer.create () in
+    let target = Nanosvg.Target.create r (Nanosvg.Bundle.get b 0) ~tx:0. ~ty:0. ~scale:1. ~w ~h in
+    ignore (Nanosvg.Target.update target);
+    Nanosvg.Shape.iter (fun s -> Nanosvg.Shape.set_fill_color s 0x7f123456l) (Nanosvg.Bundle.get b 0);
+    assert (Nanosvg.Target.update target <> None);
+    assert (Nanosvg.Target.pixels target = render (Nanosvg.Bundle.get b 0))
+  ) [false; true];
+  Sys.remove filename
+
+(* images compacted after parsing must give the same image, pixels and
+   serialized image as the ones kept as parsed *)
+let check_compact filename raw img =
+  let render raw =
+    let w = int_of_float (Nanosvg.Image_data.width raw) + 1 in
+    let h = int_of_float (Nanosvg.Image_data.height raw) + 1 in
+    let dst = Bigarray.(Array1.create int8_unsigned c_layout (w * h * 4)) in
+    let r = Nanosvg.Rasterizer.create () in
+    Nanosvg.rasterize r raw ~tx:0. ~ty:0. ~scale:1. ~dst ~w ~h ();
+    dst in
+  let compact = Nanosvg.parse_from_file ~compact:true filename |> Option.get in
+  assert (Nanosvg.lift compact = img);
+  assert (render compact = render raw);
+  List.iter (fun raw ->
+    let raw' = Option.get (Nanosvg.Image_data.of_bytes (Nanosvg.Image_data.to_bytes raw)) in
+    assert (Nanosvg.lift raw' = img);
+    assert (render raw' = render raw)
+  ) [raw; compact]
+
+(* the index must give the same answers as going through all the shapes of
+   [img], the lifted image as it is now *)
+let check_index_answers index (img: Nanosvg.image) =
+  let shapes = Array.of_list img.shapes in
+  assert (Nanosvg.Index.length index = Array.length shapes);
+  let indexed = List.filter (fun i ->
+    let s: Nanosvg.shape = shapes.(i) in
+    s.visible && (match s.payload with Nanosvg.Shape_paths _ -> true | _ -> false)
+  ) (List.init (Array.length shapes) Fun.id) in
+  let whole = Nanosvg.{ minx = -1e6; miny = -1e6; maxx = 1e6; maxy = 1e6 } in
+  assert (Array.to_list (Nanosvg.Index.query index whole) = indexed);
+  let overlaps (box: Nanosvg.box) i =
+    let s: Nanosvg.shape = shapes.(i) in
+    let ext =
+      if s.stroke = Nanosvg.Paint_none then 0.
+      else s.stroke_width *. 0.5 *. Float.max s.miter_limit 1.5 in
+    s.bounds.minx -. ext <= box.maxx && box.minx <= s.bounds.maxx +. ext &&
+    s.bounds.miny -. ext <= box.maxy && box.miny <= s.bounds.maxy +. ext in
+  let painted ~x ~y i =
+    let s = Nanosvg.Index.shape index i in
+    (Nanosvg.Shape.fill s <> Nanosvg.Paint_none && Nanosvg.Shape.fill_contains s ~x ~y) ||
+    (Nanosvg.Shape.stroke s <> Nanosvg.Paint_none && Nanosvg.Shape.stroke_width s > 0. &&
+     Nanosvg.Shape.stroke_contains ~tolerance:0.5 s ~x ~y) in
+  let st = Random.State.make [| 3 |] in
+  for _ = 1 to 200 do
+    let x = Random.State.float st img.width and y = Random.State.float st img.height in
+    let expected = List.rev (List.filter (painted ~x ~y) indexed) in
+    assert (Array.to_list (Nanosvg.Index.hits ~tolerance:0.5 index ~x ~y) = expected);
+    assert (Nanosvg.Index.pick ~tolerance:0.5 index ~x ~y = List.nth_opt expected 0)
+  done;
+  for _ = 1 to 20 do
+    let x = Random.State.float st img.width and y = Random.State.float st img.height in
+    let box = Nanosvg.{ minx = x; miny = y; maxx = x +. Random.State.float st 20.;
+                        maxy = y +. Random.State.float st 20. } in
+    assert (Array.to_list (Nanosvg.Index.query index box) = List.filter (overlaps box) indexed)
+  done
+
+let check_index raw img =
+  check_index_answers (Nanosvg.Index.create raw) img
+
+(* hit tests on shapes whose answers are known: a ring drawn with both fill
+   rules, and a stroked open polyline, on both sides of half its width plus
+   the tolerance *)
+let check_hit_tests () =
+  let svg = {|<svg xmlns="http://www.w3.org/2000/svg" width="200" height="100">
+<path d="M0 0 H100 V100 H0 Z M25 25 H75 V75 H25 Z" fill="#000" fill-rule="evenodd"/>
+<path d="M0 0 H100 V100 H0 Z M25 25 H75 V75 H25 Z" fill="#000"/>
+<path d="M0 0 H100 V100 H0 Z M25 25 V75 H75 V25 Z" fill="#000"/>
+<path d="M110 10 L190 10 L190 60" fill="none" stroke="#000" stroke-width="8"/>
+</svg>|} in
+  let raw = Nanosvg.parse svg |> Option.get in
+  let shape = Nanosvg.Shape.nth raw in
+  List.iter (fun (i, hole) ->
+    let s = shape i in
+    assert (Nanosvg.Shape.fill_contains s ~x:50. ~y:50. = hole);
+    assert (Nanosvg.Shape.fill_contains s ~x:10. ~y:50.);
+    assert (not (Nanosvg.Shape.fill_contains s ~x:(-5.) ~y:50.))
+  ) [(0, false); (1, true); (2, false)];
+  (* 4 + 0.5 away from the segments, joins and caps *)
+  let line = shape 3 in
+  List.iter (fun (x, y, inside) ->
+    assert (Nanosvg.Shape.stroke_contains ~tolerance:0.5 line ~x ~y = inside)
+  ) [(150., 14.4, true); (150., 14.6, false);
+     (194.4, 30., true); (194.6, 30., false);
+     (105.6, 10., true); (105.4, 10., false);
+     (190., 64.4, true); (190., 64.6, false);
+     (193., 7., true); (193.3, 6.7, false);
+     (* the path is open: its closing segment is not stroked *)
+     (150., 35., false)];
+  let index = Nanosvg.Index.create raw in
+  assert (Nanosvg.Index.hits ~tolerance:0.5 index ~x:50. ~y:50. = [| 1 |]);
+  assert (Nanosvg.Index.hits ~tolerance:0.5 index ~x:10. ~y:50. = [| 2; 1; 0 |]);
+  assert (Nanosvg.Index.pick ~tolerance:0.5 index ~x:150. ~y:14.4 = Some 3);
+  assert (Nanosvg.Index.pick ~tolerance:0.5 index ~x:150. ~y:14.6 = None)
+
+(* after changes to shapes, a target must hold the same pixels as a new
+   rendering of the image *)
+let check_target filename =
+  let raw = Nanosvg.parse_from_file filename |> Option.get in
+  let scale = 1.5 and tx = 1.25 and ty = -0.5 in
+  let w = int_of_float (Nanosvg.Image_data.width raw *. scale) + 3 in
+  let h = int_of_float (Nanosvg.Image_data.height raw *. scale) + 1 in
+  let r = Nanosvg.Rasterizer.create () in
+  let target = Nanosvg.Target.create r raw ~tx ~ty ~scale ~w ~h in
+  (* built before the changes, which it must follow *)
+  let index = Nanosvg.Index.create raw in
+  let prepared = Nanosvg.Prepared.create r raw ~scale in
+  assert (Nanosvg.Target.update target = Some (0, 0, w, h));
+  assert (Nanosvg.Target.update target = None);
+  let shapes = Array.of_list (Nanosvg.Shape.fold (fun l s -> s :: l) [] raw) in
+  let st = Random.State.make [| 4 |] in
+  for i = 0 to 19 do
+    let s = shapes.(Random.State.int st (Array.length shapes)) in
+    (match i mod 4 with
+     | 0 -> Nanosvg.Shape.set_fill_color s (Random.State.bits32 st)
+     | 1 -> Nanosvg.Shape.set_stroke_color s (Random.State.bits32 st)
+     | 2 -> Nanosvg.Shape.set_opacity s (Random.State.float st 1.)
+     | _ -> Nanosvg.Shape.set_visible s (not (Nanosvg.Shape.visible s)));
+    ignore (Nanosvg.Target.update target);
+    let dst = Bigarray.(Array1.create int8_unsigned c_layout (w * h * 4)) in
+    Nanosvg.rasterize r raw ~tx ~ty ~scale ~dst ~w ~h ();
+    assert (Nanosvg.Target.pixels target = dst);
+    check_index_answers index (Nanosvg.lift raw);
+    let p = Nanosvg.Prepared.create r raw ~scale in
+    let pdst = Bigarray.(Array1.create int8_unsigned c_layout (w * h * 4)) in
+    Nanosvg.rasterize_prepared r p ~tx ~ty ~dst:pdst ~w ~h ();
+    assert (pdst = dst)
+  done;
+  assert (Nanosvg.Target.update target = None);
+  (* prepared images made before the changes cannot be rendered anymore *)
+  let dst = Bigarray.(Array1.create int8_unsigned c_layout (w * h * 4)) in
+  match Nanosvg.rasterize_prepared r prepared ~tx ~ty ~dst ~w ~h () with
+  | () -> assert false
+  | exception Invalid_argument _ -> ()
+
 let read_svg filename =
-  Nanosvg.parse_from_file filename
-  |> Option.get
-  |> Nanosvg.lift
-  |> use_svg
+  let raw = Nanosvg.parse_from_file filename |> Option.get in
+  let img = Nanosvg.lift raw in
+  use_svg img;
+  check_parallel raw;
+  check_region raw;
+  check_lazy raw img;
+  check_parse_modes filename img;
+  check_rasterizers raw;
+  check_formats raw;
+  check_serialization raw img;
+  check_compact filename raw img;
+  check_index raw img;
+  check_target filename
 
 let () =
+  check_hit_tests ();
   List.iter read_svg (List.tl @@ Array.to_list Sys.argv)
@@ -0,0 +1,144 @@
+(* Text rendering tests. test.ttf is a font made for these tests: it has a
+   few geometric glyphs (A, V, o, x and the space) and a kerning pair (A, V). *)
+
+let load_font file =
+  let ic = open_in_bin file in
+  let s = really_input_string ic (in_channel_length ic) in
+  close_in ic;
+  let buf = Bigarray.(Array1.create int8_unsigned c_layout (String.length s)) in
+  String.iteri (fun i c -> buf.{i} <- Char.code c) s;
+  match Stb_truetype.enum buf with
+  | [] -> None
+  | off :: _ -> Stb_truetype.init buf off
+
+(* text over shapes, cut by the borders of the image, overlapping, with the
+   three anchors and a scaled group *)
+let svg = {|<svg xmlns="http://www.w3.org/2000/svg" width="120" height="60">
+<rect x="10" y="10" width="60" height="30" fill="#3366cc" fill-opacity="0.5"/>
+<text x="-7.3" y="20" font-family="test" font-size="16" fill="#ff0000">AVox xo</text>
+<text x="60" y="35" font-family="test" font-size="13.7" text-anchor="middle" fill="#00aa44">oxAVAx</text>
+<text x="121" y="58" font-family="test" font-size="20" text-anchor="end" fill="#102030">VAV oo</text>
+<text x="95" y="8" font-family="test" font-size="11" fill="#ffcc00">xxoAVo</text>
+<text x="50" y="40" font-family="test" font-size="9" fill="#ffffff" display="none">AAAA</text>
+<g transform="scale(1.5)"><text x="2" y="38" font-family="test" font-size="7" fill="#8800ff">Ao Vx</text></g>
+</svg>|}
+
+(* The rendering of the text shapes with the glyphs positioned as in
+   Nanosvg_text, without caching and with plain OCaml loops. *)
+let reference (img: Nanosvg.image) font ~dst ~scale ~tx ~ty ~w ~h =
+  List.iter (fun (shape: Nanosvg.shape) ->
+    match shape.payload with
+    | Shape_paths _ -> ()
+    | Shape_text txt when txt.xform.(1) = 0. && txt.xform.(2) = 0. &&
+                          txt.xform.(0) = txt.xform.(3) && shape.visible ->
+      let text_scale = txt.xform.(0) *. scale in
+      let scale = Stb_truetype.scale_for_mapping_em_to_pixels font (text_scale *. txt.fontsize) in
+      let glyphs = List.init (String.length txt.s) (fun i ->
+        Stb_truetype.get font (Char.code txt.s.[i])) in
+      let xpos = ref 0. in
+      let placed = List.mapi (fun i glyph ->
+        let q = int_of_float (Float.round (!xpos *. 4.)) in
+        let shift = q land 3 in
+        let (bitmap: Stb_truetype.glyph_bitmap) =
+          Stb_truetype.get_glyph_bitmap_subpixel font glyph ~scale_x:scale ~scale_y:scale
+            ~shift_x:(float shift /. 4.) ~shift_y:0. in
+        let kern = match List.nth_opt glyphs (i + 1) with
+          | Some next -> Stb_truetype.kern_advance font glyph next
+          | None -> 0 in
+        let advance = (Stb_truetype.hmetrics font glyph).advance_width in
+        xpos := !xpos +. scale *. (float advance +. float kern);
+        (bitmap, (q - shift) / 4 + bitmap.xoff, bitmap.yoff)
+      ) glyphs in
+      if placed <> [] then begin
+        let fold f init = List.fold_left (fun acc (b, x, y) -> f acc b x y) init placed in
+        let x0 = fold (fun m _ x _ -> min m x) max_int in
+        let y0 = fold (fun m _ _ y -> min m y) max_int in
+        let x1 = fold (fun m (b: Stb_truetype.glyph_bitmap) x _ -> max m (x + b.w)) min_int in
+        let y1 = fold (fun m (b: Stb_truetype.glyph_bitmap) _ y -> max m (y + b.h)) min_int in
+        let cw = x1 - x0 and ch = y1 - y0 in
+        let cov = Array.make (cw * ch) 0 in
+        List.iter (fun ((b: Stb_truetype.glyph_bitmap), x, y) ->
+          for j = 0 to b.h - 1 do
+            for i = 0 to b.w - 1 do
+              let k = (y - y0 + j) * cw + (x - x0 + i) in
+              let a0 = cov.(k) and a1 = b.buf.{j * b.w + i} in
+              cov.(k) <- a0 + a1 - (a0 * a1) / 255
+            done
+          done
+        ) placed;
+        let anchor_x = int_of_float (tx +. text_scale *. txt.xform.(4)) in
+        let anchor_y = int_of_float (ty +. text_scale *. txt.xform.(5)) in
+        let text_x = anchor_x + (match txt.anchor with
+          | Anchor_left -> 0
+          | Anchor_center -> -cw / 2
+          | Anchor_right -> -cw) in
+        let text_y = anchor_y + y0 in
+        let rgb = match shape.fill with
+          | Paint_color col -> Int32.(logand col 0xffffffl |> to_int)
+          | _ -> 0 in
+        for j = 0 to ch - 1 do
+          for i = 0 to cw - 1 do
+            let x = text_x + i and y = text_y + j in
+            if 0 <= x && x < w && 0 <= y && y < h then begin
+              let off = (y * w + x) * 4 in
+              let atext = cov.(j * cw + i) and adst = dst.{off + 3} in
+              let ares = adst + atext - (adst * atext) / 255 in
+              for c = 0 to 2 do
+                let ctext = (rgb lsr (8 * c)) land 0xff and cdst = dst.{off + c} in
+                dst.{off + c} <-
+                  if ares = 0 then 0
+                  else (ctext * atext + cdst * adst - cdst * atext * adst / 255) / ares
+              done;
+              dst.{off + 3} <- ares
+            end
+          done
+        done
+      end
+    | Shape_text _ -> ()
+  ) img.shapes
+
+let () =
+  let font = load_font Sys.argv.(1) |> Option.get in
+  let raw = Nanosvg.parse svg |> Option.get in
+  let img = Nanosvg.lift raw in
+  let get_font ~family = assert (family = "test"); font in
+  List.iter (fun (scale, tx, ty) ->
+    let w = int_of_float (img.width *. scale) and h = int_of_float (img.height *. scale) in
+    let background () =
+      let dst = Bigarray.(Array1.create int8_unsigned c_layout (w * h * 4)) in
+      Nanosvg.rasterize (Nanosvg.Rasterizer.create ()) raw ~tx ~ty ~scale ~dst ~w ~h ();
+      dst in
+    let render ?cache () =
+      let dst = background () in
+      Nanosvg_text.rasterize_text ?cache img ~get_font ~dst ~scale ~tx ~ty ~w ~h ();
+      dst in
+    let expected = background () in
+    reference img font ~dst:expected ~scale ~tx ~ty ~w ~h;
+    assert (expected <> background ());
+    (* without a cache, with a cache that is filled during the first rendering
+       and only read during the second one, with caches that are too small to
+       hold all the glyphs, and with a font that is a new value for each
+       text *)
+    assert (render () = expected);
+    let cache = Nanosvg_text.Glyph_cache.create () in
+    assert (render ~cache () = expected);
+    let n = Nanosvg_text.Glyph_cache.length cache in
+    assert (n > 0);
+    assert (render ~cache () = expected);
+    assert (Nanosvg_text.Glyph_cache.length cache = n);
+    let small = Nanosvg_text.Glyph_cache.create ~max_glyphs:3 () in
+    assert (render ~cache:small () = expected);
+    assert (Nanosvg_text.Glyph_cache.length small = 3);
+    (* glyphs are evicted one at a time, so that the cache stays full *)
+    let almost = Nanosvg_text.Glyph_cache.create ~max_glyphs:(n - 1) () in
+    assert (render ~cache:almost () = expected);
+    assert (render ~cache:almost () = expected);
+    assert (Nanosvg_text.Glyph_cache.length almost = n - 1);
+    let dst = background () in
+    let get_font ~family = assert (family = "test"); load_font Sys.argv.(1) |> Option.get in
+    Nanosvg_text.rasterize_text ~cache img ~get_font ~dst ~scale ~tx ~ty ~w ~h ();
+    assert (dst = expected);
+    Nanosvg_text.Glyph_cache.clear cache;
+    assert (Nanosvg_text.Glyph_cache.length cache = 0);
+    assert (render ~cache () = expected)
+  ) [(1., 0., 0.); (2.5, -13.25, 3.5); (0.75, 4., -2.)]